@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include "blockmap.h"
+#include "cache.h"
+#include "vfs.h"
+
+
+/*
+ * Block map walking. block_iter yields the data blocks of an inode one at a time
+ * (or as contiguous runs) and only ever holds two indirect clusters, so touching
+ * a small directory costs a few direct slot reads instead of a full map buffer.
+ *
+ * The map of a file may be shorter than its size: blocks past the end of the map
+ * are a hole, they read as zeros and take no cluster. An inline i-node
+ * (INODE_FLAG_INLINE) keeps its contents in the map fields and has no blocks.
+ *
+ * blockmap_get() keeps the flattened map of an inode for callers that walk the
+ * same inode repeatedly. The cached map is dropped whenever the inode is marked
+ * dirty, so a pointer to it must not be kept across changes of the inode.
+ */
+
+static bool load_refs(VFS **vfs, int32_t cluster, int32_t *refs) {
+    return cache_read(vfs, cluster, 0, refs, CLUSTER_SIZE);
+}
+
+void block_iter_init(VFS **vfs, block_iter *it, int32_t nodeid) {
+    inode *node = &(*vfs)->inodes[nodeid];
+
+    it->direct[0] = node->direct1;
+    it->direct[1] = node->direct2;
+    it->direct[2] = node->direct3;
+    it->direct[3] = node->direct4;
+    it->direct[4] = node->direct5;
+    it->indirect1 = node->indirect1;
+    it->indirect2 = node->indirect2;
+    it->stage = BLOCK_ITER_DIRECT;
+    it->pos = 0;
+    it->outer_pos = 0;
+    it->has_pending = false;
+    if (node->flags & INODE_FLAG_INLINE) it->stage = BLOCK_ITER_DONE;
+}
+
+/*
+ * Moves to the next packed list of references, loading indirect1, the first level
+ * of indirect2 and its second-level clusters as they are reached
+ */
+static bool next_packed_list(VFS **vfs, block_iter *it) {
+    if (it->stage == BLOCK_ITER_DIRECT) {
+        it->stage = BLOCK_ITER_INDIRECT1;
+        if (it->indirect1 != ID_ITEM_FREE && load_refs(vfs, it->indirect1, it->refs)) return true;
+    }
+
+    if (it->stage == BLOCK_ITER_INDIRECT1) {
+        it->stage = BLOCK_ITER_INDIRECT2;
+        it->outer_pos = 0;
+        if (it->indirect2 == ID_ITEM_FREE || !load_refs(vfs, it->indirect2, it->outer)) {
+            it->outer_pos = INT32_COUNT_IN_BLOCK;
+        }
+    }
+
+    /* First level of indirect2 is not packed, removed references leave holes */
+    while (it->outer_pos < INT32_COUNT_IN_BLOCK) {
+        int32_t inner = it->outer[it->outer_pos++];
+        if (inner > 0 && load_refs(vfs, inner, it->refs)) return true;
+    }
+
+    it->stage = BLOCK_ITER_DONE;
+    return false;
+}
+
+bool block_iter_next(VFS **vfs, block_iter *it, int32_t *block) {
+    if (it->has_pending) {
+        it->has_pending = false;
+        *block = it->pending;
+        return true;
+    }
+
+    if (it->stage == BLOCK_ITER_DIRECT) {
+        while (it->pos < 5) {
+            int32_t b = it->direct[it->pos++];
+            if (b != ID_ITEM_FREE) {
+                *block = b;
+                return true;
+            }
+        }
+    }
+
+    while (it->stage != BLOCK_ITER_DONE) {
+        /* Packed lists end at the first empty address */
+        if (it->stage != BLOCK_ITER_DIRECT && it->pos < INT32_COUNT_IN_BLOCK && it->refs[it->pos] > 0) {
+            *block = it->refs[it->pos++];
+            return true;
+        }
+        if (next_packed_list(vfs, it)) it->pos = 0;
+    }
+    return false;
+}
+
+/*
+ * Yields the next run of consecutive blocks; the block that breaks the run is kept for the next call
+ */
+bool block_iter_next_run(VFS **vfs, block_iter *it, extent *run) {
+    int32_t block;
+    if (!block_iter_next(vfs, it, &block)) return false;
+
+    run->start = block;
+    run->length = 1;
+    while (block_iter_next(vfs, it, &block)) {
+        if (block != run->start + run->length) {
+            it->pending = block;
+            it->has_pending = true;
+            break;
+        }
+        run->length++;
+    }
+    return true;
+}
+
+/*
+ * Returns the cached block map of an inode, building it on first use
+ */
+block_map *blockmap_get(VFS **vfs, int32_t nodeid) {
+    if (nodeid < 0 || nodeid >= (*vfs)->superblock->inode_count) return NULL;
+
+    if (!(*vfs)->block_maps) {
+        (*vfs)->block_maps = calloc((*vfs)->superblock->inode_count, sizeof(block_map *));
+        if (!(*vfs)->block_maps) return NULL;
+        (*vfs)->block_map_count = (*vfs)->superblock->inode_count;
+    }
+    if ((*vfs)->block_maps[nodeid]) return (*vfs)->block_maps[nodeid];
+
+    block_map *map = calloc(1, sizeof(block_map));
+    int32_t capacity = 8;
+    if (!map || !(map->blocks = malloc(capacity * sizeof(int32_t)))) {
+        free(map);
+        return NULL;
+    }
+
+    block_iter it;
+    int32_t block;
+    block_iter_init(vfs, &it, nodeid);
+    while (block_iter_next(vfs, &it, &block)) {
+        if (map->count == capacity) {
+            int32_t *grown = realloc(map->blocks, capacity * 2 * sizeof(int32_t));
+            if (!grown) {
+                free(map->blocks);
+                free(map);
+                return NULL;
+            }
+            map->blocks = grown;
+            capacity *= 2;
+        }
+        map->blocks[map->count++] = block;
+    }
+
+    (*vfs)->block_maps[nodeid] = map;
+    return map;
+}
+
+void blockmap_invalidate(VFS **vfs, int32_t nodeid) {
+    if (!(*vfs)->block_maps || nodeid < 0 || nodeid >= (*vfs)->block_map_count) return;
+
+    block_map *map = (*vfs)->block_maps[nodeid];
+    if (!map) return;
+    free(map->blocks);
+    free(map);
+    (*vfs)->block_maps[nodeid] = NULL;
+}
+
+/*
+ * Drops all cached maps (used when the image is re-formatted and the inode count changes)
+ */
+void blockmap_reset(VFS **vfs) {
+    if (!(*vfs)->block_maps) return;
+    for (int32_t i = 0; i < (*vfs)->block_map_count; i++) {
+        blockmap_invalidate(vfs, i);
+    }
+    free((*vfs)->block_maps);
+    (*vfs)->block_maps = NULL;
+    (*vfs)->block_map_count = 0;
+}
+
+/*
+ * Number of indirect clusters a file of count data blocks needs
+ */
+int32_t blockmap_meta_count(int32_t count) {
+    if (count <= DIRECT_BLOCK_COUNT) return 0;
+    count -= DIRECT_BLOCK_COUNT;
+    if (count <= INT32_COUNT_IN_BLOCK) return 1;
+    count -= INT32_COUNT_IN_BLOCK;
+    return 2 + (count + INT32_COUNT_IN_BLOCK - 1) / INT32_COUNT_IN_BLOCK;
+}
+
+/*
+ * Lays out count data blocks (at most MAX_FILE_BLOCKS) in node: the direct slots,
+ * then the packed list in indirect1, then the lists of indirect2. meta holds the
+ * blockmap_meta_count() indirect clusters in that order (indirect1, the first level
+ * of indirect2, its lists); their contents are built in meta_data, CLUSTER_SIZE
+ * zeroed bytes per cluster, and written by the caller.
+ */
+void blockmap_build(inode *node, const int32_t *blocks, int32_t count, const int32_t *meta, uint8_t *meta_data) {
+    int32_t *directs[] = {&node->direct1, &node->direct2, &node->direct3, &node->direct4, &node->direct5};
+    int32_t pos = 0;
+
+    for (int i = 0; i < DIRECT_BLOCK_COUNT; i++) {
+        *directs[i] = pos < count ? blocks[pos++] : ID_ITEM_FREE;
+    }
+    node->indirect1 = node->indirect2 = ID_ITEM_FREE;
+    if (pos == count) return;
+
+    node->indirect1 = meta[0];
+    int32_t *refs = (int32_t *) meta_data;
+    for (int i = 0; i < INT32_COUNT_IN_BLOCK && pos < count; i++) refs[i] = blocks[pos++];
+    if (pos == count) return;
+
+    node->indirect2 = meta[1];
+    int32_t *outer = (int32_t *) (meta_data + CLUSTER_SIZE);
+    for (int i = 0; pos < count; i++) {
+        outer[i] = meta[2 + i];
+        int32_t *inner = (int32_t *) (meta_data + (size_t)(2 + i) * CLUSTER_SIZE);
+        for (int j = 0; j < INT32_COUNT_IN_BLOCK && pos < count; j++) inner[j] = blocks[pos++];
+    }
+}
+
+/*
+ * Stores block in slot pos (in file order) of the map of a file. The indirect
+ * cluster holding the slot must exist. Returns false when it does not.
+ */
+bool blockmap_set(VFS **vfs, int32_t nodeid, int32_t pos, int32_t block) {
+    inode *node = &(*vfs)->inodes[nodeid];
+    int32_t *directs[] = {&node->direct1, &node->direct2, &node->direct3, &node->direct4, &node->direct5};
+
+    if (pos < DIRECT_BLOCK_COUNT) {
+        *directs[pos] = block;
+    } else {
+        int32_t cluster = node->indirect1;
+        pos -= DIRECT_BLOCK_COUNT;
+        if (pos >= INT32_COUNT_IN_BLOCK) {
+            pos -= INT32_COUNT_IN_BLOCK;
+            int32_t list = pos / INT32_COUNT_IN_BLOCK;
+            pos %= INT32_COUNT_IN_BLOCK;
+            if (node->indirect2 == ID_ITEM_FREE ||
+                !cache_read(vfs, node->indirect2, list * (int)sizeof(int32_t), &cluster, sizeof(int32_t))) {
+                return false;
+            }
+        }
+        if (cluster <= 0 || !cache_write(vfs, cluster, pos * (int)sizeof(int32_t), &block, sizeof(int32_t))) {
+            return false;
+        }
+    }
+
+    vfs_mark_inode_dirty(vfs, nodeid);
+    return true;
+}
+
+/*
+ * Gives back an indirect cluster; these are never shared
+ */
+static void release_meta(VFS **vfs, int32_t cluster) {
+    cache_invalidate(vfs, cluster);
+    bitmap_set(vfs, cluster, false);
+}
+
+/*
+ * Clears entries [from, INT32_COUNT_IN_BLOCK) of a packed list, which keeps it packed
+ */
+static void clear_list_tail(VFS **vfs, int32_t cluster, int32_t from) {
+    uint8_t *data = cache_get_cluster(vfs, cluster);
+    if (!data) return;
+    memset(data + (size_t)from * sizeof(int32_t), 0, (size_t)(INT32_COUNT_IN_BLOCK - from) * sizeof(int32_t));
+    cache_mark_dirty(vfs, cluster);
+}
+
+/*
+ * Cuts the map of a file down to its first count blocks. The blocks past it lose
+ * this owner (see refcount_release()), and indirect clusters left without
+ * entries are freed; the rest only get their tails cleared. Nothing is read or
+ * written per released data block.
+ */
+bool blockmap_truncate(VFS **vfs, int32_t nodeid, int32_t count) {
+    block_map *map = blockmap_get(vfs, nodeid);
+    if (!map) return false;
+    if (count >= map->count) return true;
+
+    for (int32_t i = count; i < map->count; i++) {
+        if (refcount_release(vfs, map->blocks[i])) cache_invalidate(vfs, map->blocks[i]);
+    }
+
+    inode *node = &(*vfs)->inodes[nodeid];
+    int32_t *directs[] = {&node->direct1, &node->direct2, &node->direct3, &node->direct4, &node->direct5};
+    for (int32_t i = count; i < DIRECT_BLOCK_COUNT; i++) *directs[i] = ID_ITEM_FREE;
+
+    if (node->indirect1 != ID_ITEM_FREE) {
+        if (count <= DIRECT_BLOCK_COUNT) {
+            release_meta(vfs, node->indirect1);
+            node->indirect1 = ID_ITEM_FREE;
+        } else if (count < DIRECT_BLOCK_COUNT + INT32_COUNT_IN_BLOCK) {
+            clear_list_tail(vfs, node->indirect1, count - DIRECT_BLOCK_COUNT);
+        }
+    }
+
+    int32_t outer[INT32_COUNT_IN_BLOCK];
+    if (node->indirect2 != ID_ITEM_FREE && cache_read(vfs, node->indirect2, 0, outer, CLUSTER_SIZE)) {
+        int32_t kept = count - DIRECT_BLOCK_COUNT - INT32_COUNT_IN_BLOCK;
+        if (kept < 0) kept = 0;
+        int32_t lists = (kept + INT32_COUNT_IN_BLOCK - 1) / INT32_COUNT_IN_BLOCK;
+
+        for (int32_t i = lists; i < INT32_COUNT_IN_BLOCK; i++) {
+            if (outer[i] > 0) release_meta(vfs, outer[i]);
+            outer[i] = 0;
+        }
+        if (kept % INT32_COUNT_IN_BLOCK != 0) {
+            clear_list_tail(vfs, outer[lists - 1], kept % INT32_COUNT_IN_BLOCK);
+        }
+
+        if (lists == 0) {
+            release_meta(vfs, node->indirect2);
+            node->indirect2 = ID_ITEM_FREE;
+        } else {
+            cache_write(vfs, node->indirect2, 0, outer, CLUSTER_SIZE);
+        }
+    }
+
+    vfs_mark_inode_dirty(vfs, nodeid);
+    return true;
+}
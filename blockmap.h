@@ -0,0 +1,17 @@
+#ifndef FS_ON_INODE_BLOCKMAP_H
+#define FS_ON_INODE_BLOCKMAP_H
+
+#include "structures.h"
+
+void block_iter_init(VFS **vfs, block_iter *it, int32_t nodeid);
+bool block_iter_next(VFS **vfs, block_iter *it, int32_t *block);
+bool block_iter_next_run(VFS **vfs, block_iter *it, extent *run);
+block_map *blockmap_get(VFS **vfs, int32_t nodeid);
+void blockmap_invalidate(VFS **vfs, int32_t nodeid);
+void blockmap_reset(VFS **vfs);
+int32_t blockmap_meta_count(int32_t count);
+bool blockmap_set(VFS **vfs, int32_t nodeid, int32_t pos, int32_t block);
+bool blockmap_truncate(VFS **vfs, int32_t nodeid, int32_t count);
+void blockmap_build(inode *node, const int32_t *blocks, int32_t count, const int32_t *meta, uint8_t *meta_data);
+
+#endif //FS_ON_INODE_BLOCKMAP_H
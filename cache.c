@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "cache.h"
+#include "vfs.h"
+
+
+/*
+ * Cluster cache in front of the data area. Entries are found through a hash
+ * of the data cluster number and kept on an LRU list; modified clusters are
+ * only written back on eviction or on cache_flush().
+ *
+ * Pointers returned by cache_get_cluster() stay valid until the entry is
+ * evicted, i.e. at least for the next MIN_CACHE_CLUSTERS - 1 lookups.
+ * Callers keep at most CACHE_POINTERS_HELD of them at once, counting the
+ * ones of the functions they are called from; a pointer held over a call
+ * that may look up more clusters than that allows is looked up again after
+ * it, and code that needs more clusters copies them with cache_read().
+ * When the image is memory-mapped the cache is bypassed and the pointers
+ * point straight into the mapping.
+ */
+
+_Static_assert(MIN_CACHE_CLUSTERS > CACHE_POINTERS_HELD,
+               "a lookup must not evict a cluster pointer still in use");
+
+block_cache *cache_create(int32_t capacity) {
+    if (capacity < MIN_CACHE_CLUSTERS) capacity = MIN_CACHE_CLUSTERS;
+
+    block_cache *cache = calloc(1, sizeof(block_cache));
+    if (!cache) return NULL;
+
+    cache->capacity = capacity;
+    cache->bucket_count = 1;
+    while (cache->bucket_count < capacity * 2) cache->bucket_count <<= 1;
+
+    cache->entries = calloc(capacity, sizeof(cache_entry));
+    cache->buckets = calloc(cache->bucket_count, sizeof(cache_entry *));
+    cache->memory = malloc((size_t)capacity * CLUSTER_SIZE);
+    if (!cache->entries || !cache->buckets || !cache->memory) {
+        cache_destroy(cache);
+        return NULL;
+    }
+
+    for (int32_t i = 0; i < capacity; i++) {
+        cache->entries[i].cluster = ID_ITEM_FREE;
+        cache->entries[i].data = cache->memory + (size_t)i * CLUSTER_SIZE;
+    }
+
+    return cache;
+}
+
+void cache_destroy(block_cache *cache) {
+    if (!cache) return;
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->memory);
+    free(cache);
+}
+
+/*
+ * Drops every entry without writing anything back (used when the image is re-formatted)
+ */
+void cache_reset(block_cache *cache) {
+    if (!cache) return;
+    memset(cache->buckets, 0, cache->bucket_count * sizeof(cache_entry *));
+    for (int32_t i = 0; i < cache->capacity; i++) {
+        cache->entries[i].cluster = ID_ITEM_FREE;
+        cache->entries[i].dirty = false;
+        cache->entries[i].prev = cache->entries[i].next = cache->entries[i].hash_next = NULL;
+    }
+    cache->used = 0;
+    cache->lru_head = cache->lru_tail = NULL;
+}
+
+static uint32_t cache_bucket(block_cache *cache, int32_t cluster) {
+    return ((uint32_t)cluster * 2654435761u) & (uint32_t)(cache->bucket_count - 1);
+}
+
+static cache_entry *cache_lookup(block_cache *cache, int32_t cluster) {
+    cache_entry *e = cache->buckets[cache_bucket(cache, cluster)];
+    while (e && e->cluster != cluster) e = e->hash_next;
+    return e;
+}
+
+static void lru_unlink(block_cache *cache, cache_entry *e) {
+    if (e->prev) e->prev->next = e->next; else cache->lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else cache->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(block_cache *cache, cache_entry *e) {
+    e->prev = NULL;
+    e->next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->prev = e;
+    cache->lru_head = e;
+    if (!cache->lru_tail) cache->lru_tail = e;
+}
+
+static void hash_unlink(block_cache *cache, cache_entry *e) {
+    cache_entry **link = &cache->buckets[cache_bucket(cache, e->cluster)];
+    while (*link && *link != e) link = &(*link)->hash_next;
+    if (*link) *link = e->hash_next;
+    e->hash_next = NULL;
+}
+
+static long cluster_offset(VFS **vfs, int32_t cluster) {
+    return (*vfs)->superblock->data_start_address + (long)cluster * CLUSTER_SIZE;
+}
+
+static void cache_write_back(VFS **vfs, cache_entry *e) {
+    vfs_pwrite(vfs, e->data, CLUSTER_SIZE, cluster_offset(vfs, e->cluster));
+    e->dirty = false;
+    (*vfs)->cache->writebacks++;
+}
+
+/*
+ * Returns the entry for cluster, taking a free one or evicting the least recently used.
+ * The returned entry is at the head of the LRU list; *hit tells if its data is valid.
+ */
+static cache_entry *cache_acquire(VFS **vfs, int32_t cluster, bool *hit) {
+    block_cache *cache = (*vfs)->cache;
+    cache_entry *e = cache_lookup(cache, cluster);
+
+    if (e) {
+        *hit = true;
+        cache->hits++;
+        lru_unlink(cache, e);
+        lru_push_front(cache, e);
+        return e;
+    }
+
+    *hit = false;
+    cache->misses++;
+    if (cache->used < cache->capacity) {
+        e = &cache->entries[cache->used++];
+    } else {
+        e = cache->lru_tail;
+        if (e->dirty) cache_write_back(vfs, e);
+        lru_unlink(cache, e);
+        hash_unlink(cache, e);
+    }
+
+    e->cluster = cluster;
+    e->dirty = false;
+    uint32_t bucket = cache_bucket(cache, cluster);
+    e->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = e;
+    lru_push_front(cache, e);
+    return e;
+}
+
+static bool cache_cluster_valid(VFS **vfs, int32_t cluster) {
+    return vfs && *vfs && (*vfs)->cache && (*vfs)->superblock &&
+           cluster >= 0 && cluster < (*vfs)->superblock->data_cluster_count;
+}
+
+/*
+ * Returns the cached contents of a data cluster, reading it from the image on a miss
+ */
+uint8_t *cache_get_cluster(VFS **vfs, int32_t cluster) {
+    if (!cache_cluster_valid(vfs, cluster)) return NULL;
+    if ((*vfs)->map) return vfs_cluster_ptr(vfs, cluster);
+
+    bool hit;
+    cache_entry *e = cache_acquire(vfs, cluster, &hit);
+    if (!hit) {
+        seek_data_cluster(vfs, cluster);
+        size_t got = vfs_read(vfs, e->data, 1, CLUSTER_SIZE);
+        if (got < CLUSTER_SIZE) memset(e->data + got, 0, CLUSTER_SIZE - got);
+    }
+    return e->data;
+}
+
+/*
+ * Returns a zero-filled dirty cluster without reading its old contents (for newly allocated clusters)
+ */
+uint8_t *cache_zero_cluster(VFS **vfs, int32_t cluster) {
+    if (!cache_cluster_valid(vfs, cluster)) return NULL;
+    if ((*vfs)->map) {
+        uint8_t *data = vfs_cluster_ptr(vfs, cluster);
+        if (data) memset(data, 0, CLUSTER_SIZE);
+        return data;
+    }
+
+    bool hit;
+    cache_entry *e = cache_acquire(vfs, cluster, &hit);
+    memset(e->data, 0, CLUSTER_SIZE);
+    e->dirty = true;
+    return e->data;
+}
+
+bool cache_read(VFS **vfs, int32_t cluster, int offset, void *ptr, int size) {
+    if (offset < 0 || size < 0 || offset + size > CLUSTER_SIZE) return false;
+    uint8_t *data = cache_get_cluster(vfs, cluster);
+    if (!data) return false;
+    memcpy(ptr, data + offset, size);
+    return true;
+}
+
+bool cache_write(VFS **vfs, int32_t cluster, int offset, const void *ptr, int size) {
+    if (offset < 0 || size < 0 || offset + size > CLUSTER_SIZE) return false;
+    uint8_t *data = cache_get_cluster(vfs, cluster);
+    if (!data) return false;
+    memcpy(data + offset, ptr, size);
+    if (!(*vfs)->map) (*vfs)->cache->lru_head->dirty = true;
+    return true;
+}
+
+/*
+ * Marks a cluster modified through a pointer from cache_get_cluster()
+ */
+void cache_mark_dirty(VFS **vfs, int32_t cluster) {
+    if (!cache_cluster_valid(vfs, cluster) || (*vfs)->map) return;
+    cache_entry *e = cache_lookup((*vfs)->cache, cluster);
+    if (e) e->dirty = true;
+}
+
+/*
+ * Forgets a cluster that was written to the image without going through the cache
+ */
+void cache_invalidate(VFS **vfs, int32_t cluster) {
+    if (!cache_cluster_valid(vfs, cluster) || (*vfs)->map) return;
+    block_cache *cache = (*vfs)->cache;
+    cache_entry *e = cache_lookup(cache, cluster);
+    if (!e) return;
+
+    hash_unlink(cache, e);
+    lru_unlink(cache, e);
+    e->cluster = ID_ITEM_FREE;
+    e->dirty = false;
+
+    /* Move to the tail so it is the next one reused */
+    if (cache->lru_tail) {
+        cache->lru_tail->next = e;
+        e->prev = cache->lru_tail;
+    } else {
+        cache->lru_head = e;
+    }
+    cache->lru_tail = e;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    int32_t x = (*(cache_entry * const *)a)->cluster;
+    int32_t y = (*(cache_entry * const *)b)->cluster;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Writes all dirty clusters back in ascending order, one pwritev per contiguous run
+ */
+void cache_flush(VFS **vfs) {
+    if (!vfs || !*vfs || !(*vfs)->cache || !(*vfs)->vfs_file || (*vfs)->map) return;
+    block_cache *cache = (*vfs)->cache;
+
+    cache_entry **dirty = malloc(cache->capacity * sizeof(cache_entry *));
+    struct iovec *iov = malloc(cache->capacity * sizeof(struct iovec));
+    if (!dirty || !iov) {
+        /* Fall back to unsorted write-back */
+        free(dirty);
+        free(iov);
+        for (cache_entry *e = cache->lru_head; e; e = e->next) {
+            if (e->dirty) cache_write_back(vfs, e);
+        }
+        return;
+    }
+
+    int count = 0;
+    for (cache_entry *e = cache->lru_head; e; e = e->next) {
+        if (e->dirty) dirty[count++] = e;
+    }
+    qsort(dirty, count, sizeof(cache_entry *), compare_entries);
+
+    for (int i = 0; i < count; ) {
+        int run = 0;
+        do {
+            iov[run].iov_base = dirty[i + run]->data;
+            iov[run].iov_len = CLUSTER_SIZE;
+            dirty[i + run]->dirty = false;
+            run++;
+        } while (i + run < count && run < MAX_WRITEBACK_RUN &&
+                 dirty[i + run]->cluster == dirty[i + run - 1]->cluster + 1);
+
+        vfs_pwritev(vfs, iov, run, cluster_offset(vfs, dirty[i]->cluster));
+        cache->writebacks += run;
+        i += run;
+    }
+
+    free(iov);
+    free(dirty);
+}
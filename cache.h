@@ -0,0 +1,17 @@
+#ifndef FS_ON_INODE_CACHE_H
+#define FS_ON_INODE_CACHE_H
+
+#include "structures.h"
+
+block_cache *cache_create(int32_t capacity);
+void cache_destroy(block_cache *cache);
+void cache_reset(block_cache *cache);
+uint8_t *cache_get_cluster(VFS **vfs, int32_t cluster);
+uint8_t *cache_zero_cluster(VFS **vfs, int32_t cluster);
+bool cache_read(VFS **vfs, int32_t cluster, int offset, void *ptr, int size);
+bool cache_write(VFS **vfs, int32_t cluster, int offset, const void *ptr, int size);
+void cache_mark_dirty(VFS **vfs, int32_t cluster);
+void cache_invalidate(VFS **vfs, int32_t cluster);
+void cache_flush(VFS **vfs);
+
+#endif //FS_ON_INODE_CACHE_H
@@ -6,8 +6,18 @@
 #include "constants.h"
 #include "vfs.h"
 #include "helpers.h"
+#include "cache.h"
+#include "blockmap.h"
+#include "dirslots.h"
+#include "dcache.h"
+#include "fileio.h"
+#include "import.h"
+#include "dedup.h"
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
 
@@ -16,17 +26,26 @@ static const char *ERR_DIRNAME[]  = {DIRNAME_NOT_DEFINED_MSG};
 static const char *ERR_FS_SIZE[] = {FS_SIZE_NOT_DEFINED_MSG};
 static const char *ERR_SRC_DEST[] = {DEST_NOT_DEFINED_MSG};
 static const char *ERR_FILE_NAME[] = {FILE_OR_DIRECTORY_NOT_DEFINED};
+static const char *ERR_SRC_AND_DEST[] = {SRC_NOT_DEFINED_MSG, DEST_NOT_DEFINED_MSG};
+static const char *ERR_INODE_AND_SIZE[] = {INODE_ID_NOT_DEFINED_MSG, FS_SIZE_NOT_DEFINED_MSG};
 
 Command commands[] = {
     {HELP_COMMAND,  false, 0, NULL, cmd_help,  "help --  Show available commands \n"},
-    {FORMAT_COMMAND,false, 1, ERR_FS_SIZE, cmd_format_vfs,"format 600M  --  Formats the virtual file system (VFS)\n"},
+    {FORMAT_COMMAND,false, 1, ERR_FS_SIZE, cmd_format_vfs,"format 600M [-z]  --  Formats the virtual file system (VFS), with -z new files are stored compressed\n"},
     {MKDIR_COMMAND, true,  1, ERR_DIRNAME,  cmd_mkdir, "mkdir a1  --  Creates new directory a1\n"},
-    {LS_COMMAND, true, 0, {}, cmd_ls, "ls a1  --  Lists the contents of the directory a1\n"},
-    {RM_COMMAND, true, 1, ERR_DIRNAME, cmd_rmdir, "rmdir a1  --  Deletes the directory a1\n"},
-    {PWD_COMMAND, true, 0, {}, cmd_pwd, "pwd  --  Lists the path to the current folder\n"},
+    {LS_COMMAND, true, 0, NULL, cmd_ls, "ls [-l] [-s|-S] [-n N [-p P]] a1  --  Lists the contents of the directory a1 (long format, sorted by name or size, page P of N entries)\n"},
+    {RMDIR_COMMAND, true, 1, ERR_DIRNAME, cmd_rmdir, "rmdir a1  --  Deletes the directory a1\n"},
+    {RM_COMMAND, true, 1, ERR_FILE_NAME, cmd_rm, "rm s1  --  Deletes the file s1\n"},
+    {CP_COMMAND, true, 2, ERR_SRC_AND_DEST, cmd_cp, "cp s1 s2  --  Copies file s1 to path s2, sharing its data clusters\n"},
+    {PWD_COMMAND, true, 0, NULL, cmd_pwd, "pwd  --  Lists the path to the current folder\n"},
     {CD_COMMAND, true, 1, ERR_SRC_DEST, cmd_cd, "cd a1  --  Changes the current folder to the directory at address a1\n"},
     {INFO_COMMAND, true, 1, ERR_FILE_NAME, cmd_info, "info a1/s1  --  Lists information about the given file/folder\n"},
-    {EXIT_COMMAND, false, 0, {}, cmd_exit, "exit -- Exit filesystem \n"}
+    {INCP_COMMAND, true, 2, ERR_SRC_AND_DEST, cmd_incp, "incp [-r] [-z] [-d] s1 s2  --  Copies file s1 (or with -r the directory tree s1) from the real file system to path s2 in the VFS, compressed with -z, sharing clusters identical to existing ones with -d\n"},
+    {CAT_COMMAND, true, 1, ERR_FILE_NAME, cmd_cat, "cat s1  --  Prints the contents of file s1\n"},
+    {OUTCP_COMMAND, true, 2, ERR_SRC_AND_DEST, cmd_outcp, "outcp s1 s2  --  Copies file s1 from the VFS to path s2 in the real file system\n"},
+    {SIZE_COMMAND, true, 2, ERR_INODE_AND_SIZE, cmd_size, "size inode_id 600M  --  Changes the size of the file with the given i-node, growing it with a hole\n"},
+    {DEDUP_COMMAND, true, 0, NULL, cmd_dedup, "dedup  --  Shares identical data clusters of all files and reports the space saved\n"},
+    {EXIT_COMMAND, false, 0, NULL, cmd_exit, "exit -- Exit filesystem \n"}
 };
 
 
@@ -40,7 +59,8 @@ bool validate_and_execute_command(VFS **vfs, Command *cmd, char *input) {
     }
 
     char *args[10] = {0};
-    for (int i = 0; i < cmd->expected_args; i++) {
+    int i;
+    for (i = 0; i < cmd->expected_args; i++) {
         args[i] = strtok(NULL, " ");
         if (str_empty(args[i])) {
             if (cmd->arg_error_msgs && cmd->arg_error_msgs[i]) {
@@ -52,8 +72,16 @@ bool validate_and_execute_command(VFS **vfs, Command *cmd, char *input) {
         }
 
     }
+    /* Optional arguments after the required ones, args stays NULL terminated */
+    while (i < 9 && (args[i] = strtok(NULL, " ")) != NULL) i++;
 
     cmd->handler(vfs, args);
+
+    /* Metadata changed by the command is written out once, here; directories over the limit are dropped */
+    if (vfs && *vfs && (*vfs)->is_formatted) {
+        vfs_commit(vfs);
+        vfs_trim_directories(vfs);
+    }
     return false;
 }
 
@@ -125,23 +153,31 @@ void cmd_format_vfs(VFS **vfs, char **args) {
         return;
     }
 
+    vfs_unmap_image(vfs);
+
     FILE *file = fopen((*vfs)->name, "wb+");
     if (!file) {
         printf(OPEN_FILE_ERR_MSG);
         return;
     }
     (*vfs)->vfs_file = file;
+    cache_reset((*vfs)->cache);
+    blockmap_reset(vfs);
+    vfs_release_directories(vfs);   /* Also clears the path cache */
 
     if (!vfs_init_memory_structures(vfs, vfs_size)) {
         fclose(file);
         printf(MEMORY_ERROR_MSG);
         return;
     }
+    if (args[1] && streq(args[1], COMPRESS_OPTION)) {
+        (*vfs)->superblock->features |= FEATURE_COMPRESSION;
+    }
 
-    char buffer[CLUSTER_SIZE];
-    memset(buffer, 0, CLUSTER_SIZE);
-    for (int i = 0; i < (*vfs)->superblock->cluster_count; i++) {
-        write_vfs(vfs, buffer, CLUSTER_SIZE, 1);
+    /* Only metadata is written, the data area is left sparse */
+    if (!vfs_reserve_image(vfs)) {
+        printf(FORMAT_RESERVE_ERROR_MSG);
+        return;
     }
 
     rewind_vfs(vfs);
@@ -153,6 +189,11 @@ void cmd_format_vfs(VFS **vfs, char **args) {
 
     flush_vfs(vfs);
 
+    if ((*vfs)->use_mmap && !vfs_map_image(vfs)) {
+        printf(MMAP_ERROR_MSG);
+        (*vfs)->use_mmap = false;
+    }
+
     (*vfs)->is_formatted = true;
 
 
@@ -181,102 +222,64 @@ void cmd_mkdir(VFS **vfs, char **args) {
 
     if (dir == NULL) dir = (*vfs)->current_dir;
 
-    if (check_if_exists(dir, name)) {
-        printf(FILE_EXISTS_MSG);
-        return;
-    }
-
-    int free_inode = vfs_find_free_inode(vfs);
-    if (free_inode == -1) {
-        printf(NO_FREE_INODE);
-        return;
-    }
-
-    int32_t *data_block = find_free_data_blocks(vfs, 1);
-    if (!data_block) {
-        printf(NOT_ENOUGH_BLOCKS_MSG);
-        return;
-    }
-
-
-    inode *new_inode = &(*vfs)->inodes[free_inode];
-    memset(new_inode, 0, sizeof(inode));
-    new_inode->nodeid = free_inode;
-    new_inode->isDirectory = true;
-    new_inode->references = 1;
-    new_inode->file_size = 0;
-    new_inode->direct1 = data_block[0];
-    new_inode->direct2 = new_inode->direct3 = new_inode->direct4 =
-    new_inode->direct5 = new_inode->indirect1 = new_inode->indirect2 = ID_ITEM_FREE;
-
-    dir_item *new_item = create_directory_item(free_inode, name);
-    if (!new_item) {
-        free(data_block);
-        printf(MEMORY_ERROR_MSG);
-        return;
-    }
-
-    directory *new_dir = calloc(1, sizeof(directory));
-    if (!new_dir) {
-        free(new_item);
-        free(data_block);
-        printf(MEMORY_ERROR_MSG);
-        return;
-    }
-
-
-    new_dir->current = new_item;
-    new_dir->parent = dir;
-    new_dir->subdir = NULL;
-    new_dir->file = NULL;
-    (*vfs)->all_dirs[free_inode] = new_dir;
-
-    (*vfs)->data_bitmap[data_block[0]] = 1;
-
-    dir_item **temp = &(dir->subdir);
-    while (*temp) temp = &((*temp)->next);
-    *temp = new_item;
-
-    if (update_directory_in_file(vfs, dir, new_item, true) == ERROR_CODE) {
-        printf("Error writing directory structure to VFS.\n");
-        free(data_block);
-        return;
-    }
-
-    update_bitmap_in_file(vfs, new_item, 1, data_block, 1);
-
-    write_inode_to_vfs(vfs, free_inode);
-    flush_vfs(vfs);
+    directory *new_dir = vfs_make_directory(vfs, dir, name);
+    if (!new_dir) return;
 
-    printf("Directory '%s' created successfully (inode %d)\n", name, free_inode);
-    free(data_block);
+    printf("Directory '%s' created successfully (inode %d)\n", name, new_dir->current->inode);
     check_sb_info(vfs);
 }
 
+/*
+ * ls [-l] [-s | -S] [-n count [-p page]] [path]
+ */
 void cmd_ls(VFS **vfs, char **args) {
 
     directory *dir = NULL;
     char *name = NULL;
+    char *path = NULL;
+    ls_options options = {false, LS_ORDER_NONE, 0, 1};
+
+    for (int i = 0; args && args[i]; i++) {
+        if (args[i][0] != '-') {
+            path = args[i];
+        } else if (streq(args[i], "-l")) {
+            options.long_format = true;
+        } else if (streq(args[i], "-s")) {
+            options.order = LS_ORDER_NAME;
+        } else if (streq(args[i], "-S")) {
+            options.order = LS_ORDER_SIZE;
+        } else if ((streq(args[i], "-n") || streq(args[i], "-p")) && args[i + 1]) {
+            char *end = NULL;
+            long value = strtol(args[i + 1], &end, 10);
+            if (end == args[i + 1] || *end != '\0' || value < 1 || value > INT32_MAX) {
+                printf(LS_OPTION_ERROR_MSG, args[i + 1]);
+                return;
+            }
+            if (args[i][1] == 'n') options.page_size = (int32_t) value;
+            else options.page = (int32_t) value;
+            i++;
+        } else {
+            printf(LS_OPTION_ERROR_MSG, args[i]);
+            return;
+        }
+    }
 
-    if (!args || !args[0] || str_empty(args[0])) {
+    if (str_empty(path)) {
         dir = (*vfs)->current_dir;
     }else {
-        if (parse_path(vfs, args[0], &name, &dir) == ERROR_CODE) {
+        if (parse_path(vfs, path, &name, &dir) == ERROR_CODE) {
             printf(PATH_NOT_FOUND_MSG);
             return;
         }
 
         if (!str_empty(name)) {
-            dir_item *sub = dir->subdir;
+            dir_item *sub = directory_find_item(dir, name);
             bool found = false;
 
-            while (sub) {
-                if (streq(sub->item_name, name)) {
-                    dir = (*vfs)->all_dirs[sub->inode];
-                    found = true;
-                    break;
-                }
-                sub = sub->next;
+            directory *sub_dir = vfs_open_directory(vfs, dir, sub);
+            if (sub_dir) {
+                dir = sub_dir;
+                found = true;
             }
 
             if (!found) {
@@ -291,7 +294,7 @@ void cmd_ls(VFS **vfs, char **args) {
         return;
     }
 
-    print_directory_content(dir);
+    print_directory_content(vfs, dir, &options);
     printf("\n");
 }
 
@@ -307,7 +310,7 @@ void cmd_rmdir(VFS **vfs, char **args) {
         return;
     }
 
-    dir_item *finding_item = find_diritem(dir->subdir, name);
+    dir_item *finding_item = directory_find_item(dir, name);
     if (!finding_item) {
         printf(FILE_NOT_FOUND_MSG);
         return;
@@ -319,15 +322,12 @@ void cmd_rmdir(VFS **vfs, char **args) {
         return;
     }
 
-    directory *finding_dir = (*vfs)->all_dirs[finding_item->inode];
-    if (!finding_dir) {
-        printf(PATH_NOT_FOUND_MSG);
-        return;
-    }
-    if (finding_dir->file != NULL || finding_dir->subdir != NULL) {
+    /* Checked on the raw clusters, the directory is not loaded just to be removed */
+    if (!vfs_directory_empty(vfs, finding_item->inode)) {
         printf(DIR_NOT_EMPTY_MSG);
         return;
     }
+    directory *finding_dir = (*vfs)->all_dirs[finding_item->inode];
 
     if (update_directory_in_file(vfs, dir, finding_item, false) == ERROR_CODE) {
         printf(PATH_NOT_FOUND_MSG);
@@ -336,50 +336,48 @@ void cmd_rmdir(VFS **vfs, char **args) {
 
     update_bitmap_in_file(vfs, finding_item, 0, NULL, 0);
 
-    nd->nodeid      = ID_ITEM_FREE;
-    nd->isDirectory = 0;
-    nd->references  = 0;
-    nd->file_size   = 0;
-    nd->direct1 = nd->direct2 = nd->direct3 = nd->direct4 = nd->direct5 = ID_ITEM_FREE;
-    nd->indirect1 = nd->indirect2 = ID_ITEM_FREE;
-    write_inode_to_vfs(vfs, finding_item->inode);
+    vfs_free_inode(vfs, finding_item->inode);
 
-    dir_item *detached = remove_diritem(&dir->subdir, name);
-    if ((*vfs)->all_dirs[finding_item->inode]) {
-        free((*vfs)->all_dirs[finding_item->inode]);
-        (*vfs)->all_dirs[finding_item->inode] = NULL;
-    }
-    free(detached);
+    dcache_invalidate_item(vfs, dir, name);
+    dir_item *detached = directory_remove_item(dir, name, true);
+    vfs_close_directory(vfs, finding_dir);
+    free_directory_item(vfs, detached);
 
     printf(OK_MSG);
 }
 
-void cmd_pwd(VFS **vfs, char **args) {
-    directory *cur = (*vfs)->current_dir;
-    char path[1024] = {0};
-    char temp[256];
+void cmd_rm(VFS **vfs, char **args) {
+    directory *dir = NULL;
+    char *name = NULL;
 
-    if (cur->current->inode == 0) {
-        printf("/\n");
+    if (parse_path(vfs, args[0], &name, &dir) == ERROR_CODE || !dir) {
+        printf(PATH_NOT_FOUND_MSG);
         return;
     }
 
-    while (cur != NULL) {
-        if (cur->current->inode != 0) {
-            snprintf(temp, sizeof(temp), "/%s", cur->current->item_name);
-
-            char new_path[1024] = {0};
-            strcpy(new_path, temp);
-            strcat(new_path, path);
-            strcpy(path, new_path);
-        }
+    dir_item *item = directory_find_item(dir, name);
+    if (!item || (*vfs)->inodes[item->inode].isDirectory) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
 
-        if (cur == cur->parent) break;
-        cur = cur->parent;
+    if (update_directory_in_file(vfs, dir, item, false) == ERROR_CODE) {
+        printf(PATH_NOT_FOUND_MSG);
+        return;
     }
 
-    if (strlen(path) == 0) {
-        strcpy(path, "/");
+    file_release(vfs, item->inode);
+    free_directory_item(vfs, directory_remove_item(dir, name, false));
+
+    printf(OK_MSG);
+}
+
+void cmd_pwd(VFS **vfs, char **args) {
+    char path[1024];
+
+    if (!directory_path((*vfs)->current_dir, path, sizeof(path))) {
+        printf(PATH_NOT_FOUND_MSG);
+        return;
     }
 
     printf("%s\n", path);
@@ -418,13 +416,7 @@ void cmd_info(VFS **vfs, char **args) {
         return;
     }
 
-    item = find_item_by_name(dir->file, name);
-    if (item != NULL) {
-        print_dir_item_info(vfs, item);
-        return;
-    }
-
-    item = find_item_by_name(dir->subdir, name);
+    item = directory_find_item(dir, name);
     if (item != NULL) {
         print_dir_item_info(vfs, item);
         return;
@@ -434,23 +426,245 @@ void cmd_info(VFS **vfs, char **args) {
 }
 
 void cmd_exit(VFS **vfs, char **args) {
+    if (vfs && *vfs) {
+        vfs_commit(vfs);
+        vfs_release_directories(vfs);
+    }
+
     printf("/--------------------\\\n");
     printf("|   END OF PROGRAM   |\n");
     printf("\\--------------------/\n\n");
 }
 
-void cmd_incp() {
+/*
+ * Resolves the destination of a copy. A destination that is an existing directory
+ * (or ends with '/') receives the file under the last component of source.
+ * Prints the reason and returns false when no new item can be created there.
+ */
+static bool copy_target(VFS **vfs, char *path, char *source, directory **dir, char **name) {
+    if (parse_path(vfs, path, name, dir) == ERROR_CODE || !*dir) {
+        printf(PATH_NOT_FOUND_MSG);
+        return false;
+    }
+
+    dir_item *existing = directory_find_item(*dir, *name);
+    directory *target = vfs_open_directory(vfs, *dir, existing);
+    if (str_empty(*name) || target) {
+        if (target) *dir = target;
+        char *slash = strrchr(source, '/');
+        *name = slash ? slash + 1 : source;
+    }
+    if (str_empty(*name)) {
+        printf(PATH_NOT_FOUND_MSG);
+        return false;
+    }
+    if (check_if_exists(*dir, *name)) {
+        printf(FILE_EXISTS_MSG);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * incp -r: mirrors the host directory source as directory path of the volume, or
+ * inside it when path is an existing directory. Existing directories are merged.
+ */
+static void incp_tree(VFS **vfs, char *source, char *path, int options) {
+    directory *dir = NULL;
+    char *name = NULL;
+
+    struct stat st;
+    if (stat(source, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf(PATH_NOT_FOUND_MSG);
+        return;
+    }
+    size_t length = strlen(source);
+    while (length > 1 && source[length - 1] == '/') source[--length] = '\0';
+
+    if (parse_path(vfs, path, &name, &dir) == ERROR_CODE || !dir) {
+        printf(PATH_NOT_FOUND_MSG);
+        return;
+    }
+    directory *target = vfs_open_directory(vfs, dir, directory_find_item(dir, name));
+    if (str_empty(name) || target) {
+        if (target) dir = target;
+        char *slash = strrchr(source, '/');
+        name = slash ? slash + 1 : source;
+    }
+
+    dir_item *existing = directory_find_item(dir, name);
+    directory *root = existing ? vfs_open_directory(vfs, dir, existing) : vfs_make_directory(vfs, dir, name);
+    if (!root) {
+        if (existing) printf(FILE_EXISTS_MSG);
+        return;
+    }
+
+    if (import_tree(vfs, source, root, options)) printf(OK_MSG);
+}
+
+/*
+ * incp s1 s2: s2 is the new file, or an existing directory to put it in under the name of s1
+ */
+void cmd_incp(VFS **vfs, char **args) {
+    directory *dir = NULL;
+    char *name = NULL;
+    bool recursive = false;
+    int options = vfs_compress_enabled(vfs) ? STORE_COMPRESSED : 0;
+
+    for (; args[0] && args[0][0] == '-'; args++) {
+        if (streq(args[0], RECURSIVE_OPTION)) recursive = true;
+        else if (streq(args[0], COMPRESS_OPTION)) options |= STORE_COMPRESSED;
+        else if (streq(args[0], DEDUP_OPTION)) options |= STORE_DEDUP;
+        else break;
+    }
+    char *source = args[0];
+    if (str_empty(source) || str_empty(args[1])) {
+        printf(str_empty(source) ? SRC_NOT_DEFINED_MSG : DEST_NOT_DEFINED_MSG);
+        return;
+    }
+    if ((options & STORE_DEDUP) && !(*vfs)->dedup_index) {
+        printf(DEDUP_UNSUPPORTED_MSG);
+        options &= ~STORE_DEDUP;
+    }
+    (*vfs)->dedup_saved = 0;
+
+    if (recursive) {
+        incp_tree(vfs, source, args[1], options);
+        if (options & STORE_DEDUP) {
+            printf(DEDUP_SAVED_MSG, (*vfs)->dedup_saved, (long long)(*vfs)->dedup_saved * CLUSTER_SIZE);
+        }
+        return;
+    }
+
+    if (!copy_target(vfs, args[1], source, &dir, &name)) return;
+
+    int fd = open(source, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int32_t id = file_import(vfs, fd, st.st_size, options);
+    close(fd);
+    if (id == ID_ITEM_FREE || !file_link(vfs, dir, name, id)) return;
 
+    if (options & STORE_DEDUP) {
+        printf(DEDUP_SAVED_MSG, (*vfs)->dedup_saved, (long long)(*vfs)->dedup_saved * CLUSTER_SIZE);
+    }
+    printf(OK_MSG);
 }
 
 
-void cmd_outcp() {
+void cmd_cat(VFS **vfs, char **args) {
+    directory *dir = NULL;
+    char *name = NULL;
+
+    if (parse_path(vfs, args[0], &name, &dir) == ERROR_CODE || !dir) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+
+    dir_item *item = directory_find_item(dir, name);
+    if (!item || (*vfs)->inodes[item->inode].isDirectory) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
 
+    if (!file_print(vfs, item->inode, stdout)) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+    printf("\n");
 }
 
-void cmd_cp(){
+/*
+ * size inode_id size: truncates or extends a file, see file_resize()
+ */
+void cmd_size(VFS **vfs, char **args) {
+    char *end = NULL;
+    long id = strtol(args[0], &end, 10);
+    if (*end != '\0' || id < 0 || id >= (*vfs)->superblock->inode_count ||
+        (*vfs)->inodes[id].nodeid == ID_ITEM_FREE || (*vfs)->inodes[id].isDirectory) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+
+    int64_t size;
+    if (!parse_size(args[1], &size)) {
+        printf(INVALID_SIZE_MSG, args[1]);
+        return;
+    }
 
+    if (file_resize(vfs, (int32_t)id, size)) printf(OK_MSG);
 }
 
+void cmd_outcp(VFS **vfs, char **args) {
+    directory *dir = NULL;
+    char *name = NULL;
+
+    if (parse_path(vfs, args[0], &name, &dir) == ERROR_CODE || !dir) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+
+    dir_item *item = directory_find_item(dir, name);
+    if (!item || (*vfs)->inodes[item->inode].isDirectory) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+
+    int fd = open(args[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf(PATH_NOT_FOUND_MSG);
+        return;
+    }
 
+    bool ok = file_export(vfs, item->inode, fd);
+    if (close(fd) != 0) ok = false;
+    printf(ok ? OK_MSG : PATH_NOT_FOUND_MSG);
+}
 
+/*
+ * Copies a file inside the volume. The copy shares the data clusters of the
+ * source (see file_copy()), only its inode and indirect clusters are new.
+ */
+void cmd_cp(VFS **vfs, char **args) {
+    directory *dir = NULL;
+    char *name = NULL;
+
+    if (parse_path(vfs, args[0], &name, &dir) == ERROR_CODE || !dir) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+
+    dir_item *item = directory_find_item(dir, name);
+    if (!item || (*vfs)->inodes[item->inode].isDirectory) {
+        printf(FILE_NOT_FOUND_MSG);
+        return;
+    }
+    int32_t source = item->inode;
+
+    if (!copy_target(vfs, args[1], args[0], &dir, &name)) return;
+
+    int32_t id = file_copy(vfs, source);
+    if (id == ID_ITEM_FREE || !file_link(vfs, dir, name, id)) return;
+
+    printf(OK_MSG);
+}
+
+/*
+ * dedup: shares the identical data clusters of all files of the volume
+ */
+void cmd_dedup(VFS **vfs, char **args) {
+    (void)args;
+
+    int32_t freed = dedup_volume(vfs);
+    if (freed < 0) {
+        printf(DEDUP_UNSUPPORTED_MSG);
+        return;
+    }
+    printf(DEDUP_SAVED_MSG, freed, (long long)freed * CLUSTER_SIZE);
+}
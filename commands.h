@@ -17,12 +17,16 @@ void cmd_format_vfs(VFS **vfs, char **args);
 void cmd_mkdir(VFS **vfs, char **args);
 void cmd_ls(VFS **vfs, char **args);
 void cmd_rmdir(VFS **vfs, char **args);
+void cmd_rm(VFS **vfs, char **args);
 void cmd_pwd(VFS **vfs, char **args);
 void cmd_cd(VFS **vfs, char **args);
 void cmd_info(VFS **vfs, char **args);
-void cmd_incp();
-void cmd_outcp();
-void cmd_cp();
+void cmd_incp(VFS **vfs, char **args);
+void cmd_outcp(VFS **vfs, char **args);
+void cmd_cp(VFS **vfs, char **args);
+void cmd_cat(VFS **vfs, char **args);
+void cmd_size(VFS **vfs, char **args);
+void cmd_dedup(VFS **vfs, char **args);
 void cmd_format();
 void cmd_help();
 void cmd_exit(VFS **vfs, char **args);
@@ -0,0 +1,158 @@
+#include <stdbool.h>
+#include <string.h>
+#include "compress.h"
+#include "constants.h"
+
+
+/*
+ * Byte-oriented LZ77 codec for file data. A compressed block is a list of
+ * sequences, each a token byte (literal count in the high nibble, match length
+ * minus LZ_MIN_MATCH in the low one), the literals and a two byte offset back
+ * into the output. A nibble of 15 is continued by bytes of 255 and a last
+ * smaller one. The final sequence holds literals only.
+ *
+ * A compressed file stores its data in groups of COMPRESS_GROUP_SIZE bytes, each
+ * starting on a cluster. The first compress_header_count() blocks of its map
+ * hold the stored length of every group; a group whose length equals its plain
+ * size is stored as it is.
+ */
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, int length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/*
+ * Appends one sequence; match_length 0 ends the block. Returns NULL when the
+ * sequence does not fit before oend.
+ */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, int literal_count,
+                             int offset, int match_length) {
+    int match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    long worst = 1 + literal_count / 255 + 1 + literal_count + 2 + match_code / 255 + 1;
+    if (worst > oend - op) return NULL;
+
+    *op++ = (uint8_t)(((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_count >= 15) op = put_length(op, literal_count - 15);
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (match_length == 0) return op;
+
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (match_code >= 15) op = put_length(op, match_code - 15);
+    return op;
+}
+
+/*
+ * Compresses size bytes of src into at most capacity bytes of dst. Returns the
+ * compressed size, or 0 when it would not fit.
+ */
+int lz_compress(const uint8_t *src, int size, uint8_t *dst, int capacity) {
+    int32_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *iend = src + size;
+    uint8_t *op = dst, *oend = dst + capacity;
+
+    memset(table, 0xff, sizeof(table));
+    while (iend - ip >= LZ_MIN_MATCH) {
+        uint32_t seq = read32(ip);
+        uint32_t h = lz_hash(seq);
+        int32_t ref = table[h];
+        table[h] = (int32_t)(ip - src);
+
+        if (ref < 0 || ip - src - ref > LZ_MAX_OFFSET || read32(src + ref) != seq) {
+            /* Steps grow on long runs without a match, incompressible data is skipped faster */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        const uint8_t *match = src + ref;
+        int length = LZ_MIN_MATCH;
+        while (ip + length < iend && ip[length] == match[length]) length++;
+
+        op = put_sequence(op, oend, anchor, (int)(ip - anchor), (int)(ip - match), length);
+        if (!op) return 0;
+        ip += length;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, (int)(iend - anchor), 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+static bool get_length(const uint8_t **ip, const uint8_t *iend, long *length) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+/*
+ * Decompresses size bytes of src into at most capacity bytes of dst. Returns the
+ * decompressed size, or -1 when src is not a valid block.
+ */
+int lz_decompress(const uint8_t *src, int size, uint8_t *dst, int capacity) {
+    const uint8_t *ip = src, *iend = src + size;
+    uint8_t *op = dst, *oend = dst + capacity;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        long literal_count = token >> 4;
+        if (literal_count == 15 && !get_length(&ip, iend, &literal_count)) return -1;
+        if (literal_count > iend - ip || literal_count > oend - op) return -1;
+        memcpy(op, ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        long offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        long length = token & 15;
+        if (length == 15 && !get_length(&ip, iend, &length)) return -1;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - dst || length > oend - op) return -1;
+
+        /* Overlapping matches repeat the last offset bytes, they are copied forward */
+        const uint8_t *match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+        } else {
+            for (long i = 0; i < length; i++) op[i] = match[i];
+        }
+        op += length;
+    }
+    return (int)(op - dst);
+}
+
+/*
+ * Number of COMPRESS_GROUP_SIZE groups of a file of size bytes
+ */
+int32_t compress_group_count(int64_t size) {
+    return (int32_t)((size + COMPRESS_GROUP_SIZE - 1) / COMPRESS_GROUP_SIZE);
+}
+
+/*
+ * Number of clusters holding the group lengths of a file of size bytes
+ */
+int32_t compress_header_count(int64_t size) {
+    int64_t bytes = (int64_t)compress_group_count(size) * sizeof(uint32_t);
+    return (int32_t)((bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+}
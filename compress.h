@@ -0,0 +1,11 @@
+#ifndef FS_ON_INODE_COMPRESS_H
+#define FS_ON_INODE_COMPRESS_H
+
+#include <stdint.h>
+
+int lz_compress(const uint8_t *src, int size, uint8_t *dst, int capacity);
+int lz_decompress(const uint8_t *src, int size, uint8_t *dst, int capacity);
+int32_t compress_group_count(int64_t size);
+int32_t compress_header_count(int64_t size);
+
+#endif //FS_ON_INODE_COMPRESS_H
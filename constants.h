@@ -12,16 +12,62 @@
 #define CLUSTER_SIZE            4096    // 4 kB
 #define INT32_COUNT_IN_BLOCK (CLUSTER_SIZE / 4)
 #define INODE_SIZE              40
+#define INODES_PER_CLUSTER      (CLUSTER_SIZE / INODE_SIZE)
+#define INODE_IO_BATCH          (64 * INODES_PER_CLUSTER)   // records per bulk read/write
 #define MIN_FS           102400
 #define NEGATIVE_SIZE_OF_INT32  -4
 #define ID_ITEM_FREE            -1
 #define EMPTY_ADDRESS           0
+#define BITMAP_WORD_BITS        64
+#define FEATURE_PACKED_BITMAP   0x1     // data bitmap stores one bit per cluster
+#define FEATURE_INODE_BITMAP    0x2     // image has an inode bitmap region
+#define FEATURE_REFCOUNTS       0x4     // image has a region with a reference count per data cluster
+#define FEATURE_INLINE_DATA     0x8     // i-nodes may hold their contents in place of the block map
+#define FEATURE_COMPRESSION     0x10    // new files are stored compressed
+#define FEATURE_DEDUP_INDEX     0x20    // image has a region mapping cluster hashes to clusters
+#define MAX_CLUSTER_SHARES      UINT16_MAX  // extra references a cluster can take
+#define DIR_INDEX_MIN_CAPACITY  16
+#define LOADED_DIRS_LIMIT       1024    // directories kept in memory between commands
+#define DCACHE_ENTRIES          1024    // resolved paths kept, power of two
+#define DCACHE_PATH_LENGTH      256
+#define LS_BUFFER_SIZE          (64 * 1024)     // ls output is written in blocks of this size
+#define LS_ORDER_NONE           0
+#define LS_ORDER_NAME           1
+#define LS_ORDER_SIZE           2
+#define SLAB_SIZE               (64 * 1024)     // bytes per slab of dir_item / directory nodes
+#define BLOCK_ITER_DIRECT       0
+#define BLOCK_ITER_INDIRECT1    1
+#define BLOCK_ITER_INDIRECT2    2
+#define BLOCK_ITER_DONE         3
 #define DIR_ENTRY_SIZE (sizeof(int32_t) + MAX_ITEM_NAME_LENGTH)
-#define MAX_DIR_ENTRIES_PER_CLUSTER (CLUSTER_SIZE / DIR_ENTRY_SIZE)
+#define MAX_DIR_ENTRIES_PER_CLUSTER ((int) (CLUSTER_SIZE / DIR_ENTRY_SIZE))
+#define DIR_SLOT_WORDS (MAX_DIR_ENTRIES_PER_CLUSTER / BITMAP_WORD_BITS)
+#define BLOCK_CACHE_CLUSTERS    256     // default cache capacity (1 MB)
+#define MIN_CACHE_CLUSTERS      4
+#define CACHE_POINTERS_HELD     2       // most cache_get_cluster() pointers in use at once, over nested calls
+#define MAX_WRITEBACK_RUN       256     // clusters per vectored write
+#define EXTENT_FIT_CANDIDATES   64      // free runs tried from the hint before the full best-fit scan
+#define DIRECT_BLOCK_COUNT      5
+#define INODE_FLAG_INLINE       0x1     // contents are stored in the block map fields
+#define INODE_FLAG_COMPRESSED   0x2     // data is stored in compressed groups, see compress.c
+#define STORE_COMPRESSED        0x1     // file_reserve() option: compress the data
+#define STORE_DEDUP             0x2     // file_reserve() option: share clusters with identical indexed ones
+#define INLINE_DATA_SIZE        (7 * (int) sizeof(int32_t))     // bytes the block map fields can hold
+#define MAX_FILE_BLOCKS         (DIRECT_BLOCK_COUNT + INT32_COUNT_IN_BLOCK + INT32_COUNT_IN_BLOCK * INT32_COUNT_IN_BLOCK)
+#define IO_CHUNK_CLUSTERS       256     // clusters moved per host read/write (1 MB)
+#define IMPORT_THREADS_MAX      16      // workers of a recursive incp
+#define IMPORT_QUEUE_LIMIT      256     // files queued ahead of the workers
+#define DEDUP_WAYS              4       // index entries a hash may take, one 64-byte set
+#define COMPRESS_GROUP_CLUSTERS 16      // clusters compressed together
+#define COMPRESS_GROUP_SIZE     (COMPRESS_GROUP_CLUSTERS * CLUSTER_SIZE)
+#define LZ_HASH_BITS            12      // match finder table of 4096 positions
+#define LZ_MIN_MATCH            4
+#define LZ_MAX_OFFSET           65535
+#define READAHEAD_CLUSTERS      1024    // clusters of the next run requested ahead of a sequential read (4 MB)
 
 
 #define FORMAT_VFS "Do you want to format new filesystem? (y/n): "
-#define SRC_NOT_DEFINED_MSG "\n"
+#define SRC_NOT_DEFINED_MSG "Source path not defined \n"
 #define DEST_NOT_DEFINED_MSG "Destination path not defined \n"
 #define FILE_OR_DIRECTORY_NOT_DEFINED "Directory or file path not defined \n"
 #define DIRNAME_NOT_DEFINED_MSG "Directory name is not define \n"
@@ -29,7 +75,11 @@
 #define OPEN_FILE_ERR_MSG ""
 #define FS_SIZE_NOT_DEFINED_MSG "File size not defined.\n"
 #define FORMAT_SUCCESS_MSG ""
+#define FORMAT_RESERVE_ERROR_MSG "Cannot resize the filesystem image.\n"
 #define ERROR_SB_READING "Error reading superblock.\n"
+#define ERROR_INODES_READING "Error reading inode table.\n"
+#define BITMAP_UPGRADE_MSG "Converting data bitmap to the packed format.\n"
+#define INODE_BITMAP_REPAIR_MSG "Inode bitmap does not match the inode table, rebuilding it.\n"
 #define ERROR_LOADING "Error: directory structure corrupted or incomplete.\n"
 #define NO_FREE_INODE "No free inode available.\n"
 #define OK_MSG "OK \n"
@@ -39,6 +89,14 @@
 #define FILE_NOT_FOUND_MSG      "FILE NOT FOUND (source does not exist)\n"
 #define FILE_EXISTS_MSG         "EXIST (cannot create, already exists)\n"
 #define DIR_NOT_EMPTY_MSG       "NOT EMPTY (directory contains subdirectories or files)\n"
+#define LS_OPTION_ERROR_MSG "Unknown ls option: '%s'. Use -l, -s, -S, -n <count> and -p <page>.\n"
+#define IMPORT_FAILED_MSG "Cannot import '%s'\n"
+#define IMPORT_SUMMARY_MSG "Imported %d files, created %d directories, %d failed\n"
+#define INODE_ID_NOT_DEFINED_MSG "I-node id not defined \n"
+#define DEDUP_SAVED_MSG "Deduplicated %d clusters, %lld B saved\n"
+#define DEDUP_UNSUPPORTED_MSG "The image has no deduplication index, clusters are not deduplicated.\n"
+#define INVALID_SIZE_MSG "Invalid size '%s' (bytes, or with a K, M or G suffix).\n"
+#define FILE_TOO_LARGE_MSG "FILE TOO LARGE (does not fit into one i-node)\n"
 #define NOT_ENOUGH_BLOCKS_MSG "Not enough blocks found. Probably no more space available. \n"
 
 
@@ -52,6 +110,9 @@
 #define CD_COMMAND "cd"
 #define LS_COMMAND "ls"
 #define CAT_COMMAND "cat"
+#define RECURSIVE_OPTION "-r"
+#define COMPRESS_OPTION "-z"
+#define DEDUP_OPTION "-d"
 #define PWD_COMMAND "pwd"
 #define INFO_COMMAND "info"
 #define RM_COMMAND "rm"
@@ -61,6 +122,7 @@
 #define LOAD_COMMAND "load"
 #define CHECK_COMMAND "check"
 #define SIZE_COMMAND "size"
+#define DEDUP_COMMAND "dedup"
 
 
 
@@ -71,5 +133,6 @@
 #define VFS_LOADING "Loading virtual filesystem: %s\n"
 #define VFS_ERROR "Error loading virtual filesystem: %s\n"
 #define VFS_LOAD_SUCCESS "VFS successfully initialized.\n"
+#define MMAP_ERROR_MSG "Cannot map the filesystem image, using file I/O.\n"
 
 #endif //FS_ON_INODE_CONSTANTS_H
\ No newline at end of file
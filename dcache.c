@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dcache.h"
+#include "helpers.h"
+
+
+/*
+ * Directory path cache. Maps normalized absolute paths to loaded directories, or
+ * to NULL for paths that do not name a directory, so repeated lookups of the same
+ * path skip the component walk. Direct-mapped: a new path replaces whatever
+ * shared its slot.
+ *
+ * Entries are dropped for a path and everything below it when a directory is
+ * created, removed or evicted there. Files never appear as positive entries, so
+ * creating or removing one does not touch the cache.
+ */
+
+static uint32_t path_hash(const char *path, int32_t length) {
+    uint32_t hash = 2166136261u;    /* FNV-1a */
+    for (int32_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+    }
+    return hash;
+}
+
+dentry_cache *dcache_create(void) {
+    dentry_cache *dcache = calloc(1, sizeof(dentry_cache));
+    if (!dcache) return NULL;
+
+    dcache->entries = calloc(DCACHE_ENTRIES, sizeof(dentry));
+    if (!dcache->entries) {
+        free(dcache);
+        return NULL;
+    }
+    return dcache;
+}
+
+void dcache_destroy(dentry_cache *dcache) {
+    if (!dcache) return;
+    free(dcache->entries);
+    free(dcache);
+}
+
+/*
+ * Drops every entry (used when the image is re-formatted)
+ */
+void dcache_reset(dentry_cache *dcache) {
+    if (!dcache) return;
+    memset(dcache->entries, 0, DCACHE_ENTRIES * sizeof(dentry));
+}
+
+/*
+ * Returns true when path is cached; *dir is then its directory or NULL
+ */
+bool dcache_lookup(dentry_cache *dcache, const char *path, directory **dir) {
+    if (!dcache) return false;
+
+    int32_t length = (int32_t)strlen(path);
+    dentry *entry = &dcache->entries[path_hash(path, length) & (DCACHE_ENTRIES - 1)];
+    if (entry->length != length || length == 0 || memcmp(entry->path, path, length) != 0) {
+        dcache->misses++;
+        return false;
+    }
+
+    dcache->hits++;
+    *dir = entry->dir;
+    return true;
+}
+
+void dcache_insert(dentry_cache *dcache, const char *path, directory *dir) {
+    if (!dcache) return;
+
+    int32_t length = (int32_t)strlen(path);
+    if (length == 0 || length >= DCACHE_PATH_LENGTH) return;
+
+    dentry *entry = &dcache->entries[path_hash(path, length) & (DCACHE_ENTRIES - 1)];
+    memcpy(entry->path, path, length + 1);
+    entry->length = length;
+    entry->dir = dir;
+}
+
+/*
+ * Drops path and every cached path below it
+ */
+void dcache_invalidate(dentry_cache *dcache, const char *path) {
+    if (!dcache) return;
+
+    int32_t length = (int32_t)strlen(path);
+    for (int32_t i = 0; i < DCACHE_ENTRIES; i++) {
+        dentry *entry = &dcache->entries[i];
+        if (entry->length < length || memcmp(entry->path, path, length) != 0) continue;
+        if (entry->length > length && entry->path[length] != '/') continue;
+
+        entry->path[0] = '\0';
+        entry->length = 0;
+        entry->dir = NULL;
+    }
+}
+
+/*
+ * Drops the cached paths of the item called name in parent and below it
+ */
+void dcache_invalidate_item(VFS **vfs, directory *parent, const char *name) {
+    char path[DCACHE_PATH_LENGTH];
+
+    /* Paths that do not fit are never cached */
+    if (!(*vfs)->dcache || !directory_path(parent, path, sizeof(path))) return;
+
+    size_t length = strlen(path);
+    size_t name_length = strnlen(name, MAX_ITEM_NAME_LENGTH);
+    if (length == 1) length = 0;    /* Root */
+    if (length + 1 + name_length >= sizeof(path)) return;
+
+    path[length] = '/';
+    memcpy(path + length + 1, name, name_length);
+    path[length + 1 + name_length] = '\0';
+    dcache_invalidate((*vfs)->dcache, path);
+}
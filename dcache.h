@@ -0,0 +1,14 @@
+#ifndef FS_ON_INODE_DCACHE_H
+#define FS_ON_INODE_DCACHE_H
+
+#include "structures.h"
+
+dentry_cache *dcache_create(void);
+void dcache_destroy(dentry_cache *dcache);
+void dcache_reset(dentry_cache *dcache);
+bool dcache_lookup(dentry_cache *dcache, const char *path, directory **dir);
+void dcache_insert(dentry_cache *dcache, const char *path, directory *dir);
+void dcache_invalidate(dentry_cache *dcache, const char *path);
+void dcache_invalidate_item(VFS **vfs, directory *parent, const char *name);
+
+#endif //FS_ON_INODE_DCACHE_H
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "dedup.h"
+#include "vfs.h"
+#include "blockmap.h"
+
+
+/*
+ * Cluster deduplication. The index maps a 64-bit hash of a data cluster to one
+ * cluster with that hash. A hash may take any entry of a set of DEDUP_WAYS;
+ * when the set is full a newer cluster replaces an older one. An entry is only a hint: the contents are compared
+ * before a cluster is shared, so collisions and stale entries cost a read but
+ * never data. Clusters leave the index when their last owner releases them (see
+ * refcount_release()) or when they are changed in place.
+ */
+
+/*
+ * MurmurHash64A of one cluster
+ */
+uint64_t dedup_hash(const uint8_t *data) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t h = 0x9747b28cULL ^ ((uint64_t)CLUSTER_SIZE * m);
+
+    for (int i = 0; i < CLUSTER_SIZE; i += (int)sizeof(uint64_t)) {
+        uint64_t k;
+        memcpy(&k, data + i, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+/*
+ * Reads a data cluster straight from the image; clusters never written read as zeros
+ */
+static bool read_cluster(VFS **vfs, int32_t cluster, uint8_t *data) {
+    long offset = vfs_cluster_offset(vfs, cluster);
+    if ((*vfs)->map) {
+        if ((size_t)offset + CLUSTER_SIZE > (*vfs)->map_size) return false;
+        memcpy(data, (*vfs)->map + offset, CLUSTER_SIZE);
+        return true;
+    }
+
+    ssize_t got;
+    do {
+        got = pread(fileno((*vfs)->vfs_file), data, CLUSTER_SIZE, offset);
+    } while (got < 0 && errno == EINTR);
+    if (got < 0) return false;
+    memset(data + got, 0, CLUSTER_SIZE - (size_t)got);
+    return true;
+}
+
+/*
+ * Returns an indexed cluster other than block with the same contents, or 0
+ */
+static int32_t dedup_match(VFS **vfs, int32_t block, uint64_t hash) {
+    int32_t set = (int32_t)(hash & (uint64_t)(dedup_bucket_count(vfs) - 1)) & ~(DEDUP_WAYS - 1);
+    uint8_t ours[CLUSTER_SIZE], theirs[CLUSTER_SIZE];
+    bool loaded = false;
+
+    for (int32_t i = set; i < set + DEDUP_WAYS; i++) {
+        dedup_entry *entry = &(*vfs)->dedup_index[i];
+        if (entry->cluster <= 0 || entry->cluster == block || entry->hash != hash || !bitmap_get(vfs, entry->cluster)) {
+            continue;
+        }
+        if (!loaded && !(loaded = read_cluster(vfs, block, ours))) return 0;
+        if (read_cluster(vfs, entry->cluster, theirs) && memcmp(ours, theirs, CLUSTER_SIZE) == 0) return entry->cluster;
+    }
+    return 0;
+}
+
+/*
+ * Points block pos of file id at an identical indexed cluster, or indexes the
+ * block when there is none. Returns true when the block was freed by that.
+ */
+static bool dedup_block(VFS **vfs, int32_t id, int32_t pos, int32_t block, uint64_t hash) {
+    int32_t match = dedup_match(vfs, block, hash);
+    if (match > 0 && refcount_share(vfs, match)) {
+        if (blockmap_set(vfs, id, pos, match)) return refcount_release(vfs, block);
+        refcount_release(vfs, match);
+        return false;
+    }
+
+    /* A cluster with the most owners is replaced, identical ones share this one from now on */
+    dedup_insert(vfs, hash, block);
+    return false;
+}
+
+/*
+ * Deduplicates the count data blocks of file id, whose hashes are known. The
+ * clusters must already be in the image. Returns how many clusters were freed.
+ */
+int32_t dedup_file(VFS **vfs, int32_t id, const int32_t *blocks, int32_t count, const uint64_t *hashes) {
+    int32_t freed = 0;
+    if (!(*vfs)->dedup_index) return 0;
+
+    for (int32_t i = 0; i < count; i++) {
+        if (dedup_block(vfs, id, i, blocks[i], hashes[i])) freed++;
+    }
+    (*vfs)->dedup_saved += freed;
+    return freed;
+}
+
+/*
+ * Hashes every data cluster of every file and shares the identical ones.
+ * Directories and inline files have no data clusters to share. Returns how
+ * many clusters were freed, or -1 when the image has no index.
+ */
+int32_t dedup_volume(VFS **vfs) {
+    if (!(*vfs)->dedup_index) return -1;
+
+    /* The image file is read directly, cached clusters must be there first */
+    flush_vfs(vfs);
+
+    int32_t freed = 0;
+    uint8_t data[CLUSTER_SIZE];
+    for (int32_t id = 0; id < (*vfs)->superblock->inode_count; id++) {
+        inode *node = &(*vfs)->inodes[id];
+        if (node->nodeid == ID_ITEM_FREE || node->isDirectory || (node->flags & INODE_FLAG_INLINE)) continue;
+
+        /* The map changes while the file is walked, a copy of it is walked instead */
+        block_map *map = blockmap_get(vfs, id);
+        int32_t count = map ? map->count : 0;
+        int32_t *blocks = count > 0 ? malloc((size_t)count * sizeof(int32_t)) : NULL;
+        if (!blocks) continue;
+        memcpy(blocks, map->blocks, (size_t)count * sizeof(int32_t));
+
+        for (int32_t i = 0; i < count; i++) {
+            if (read_cluster(vfs, blocks[i], data) && dedup_block(vfs, id, i, blocks[i], dedup_hash(data))) freed++;
+        }
+        free(blocks);
+    }
+
+    (*vfs)->dedup_saved += freed;
+    return freed;
+}
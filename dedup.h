@@ -0,0 +1,10 @@
+#ifndef FS_ON_INODE_DEDUP_H
+#define FS_ON_INODE_DEDUP_H
+
+#include "structures.h"
+
+uint64_t dedup_hash(const uint8_t *data);
+int32_t dedup_file(VFS **vfs, int32_t id, const int32_t *blocks, int32_t count, const uint64_t *hashes);
+int32_t dedup_volume(VFS **vfs);
+
+#endif //FS_ON_INODE_DEDUP_H
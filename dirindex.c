@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dirindex.h"
+
+
+/*
+ * Name index of one directory: open addressing with linear probing over the
+ * dir_items of both lists. Names are compared on MAX_ITEM_NAME_LENGTH bytes like
+ * the list searches. Removed slots are left as tombstones until the next rehash.
+ */
+
+static dir_item tombstone;
+
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;    /* FNV-1a */
+    for (int i = 0; i < MAX_ITEM_NAME_LENGTH && name[i]; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns the slot holding name, or the empty slot that ends its probe sequence
+ */
+static int32_t find_slot(const dir_index *index, const char *name) {
+    uint32_t mask = (uint32_t)index->capacity - 1;
+    uint32_t slot = name_hash(name) & mask;
+
+    while (index->slots[slot]) {
+        if (index->slots[slot] != &tombstone &&
+            strncmp(index->slots[slot]->item_name, name, MAX_ITEM_NAME_LENGTH) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return (int32_t)slot;
+}
+
+static bool rehash(dir_index *index, int32_t capacity) {
+    dir_item **slots = calloc(capacity, sizeof(dir_item *));
+    if (!slots) return false;
+
+    for (int32_t i = 0; i < index->capacity; i++) {
+        dir_item *item = index->slots[i];
+        if (!item || item == &tombstone) continue;
+
+        uint32_t slot = name_hash(item->item_name) & (uint32_t)(capacity - 1);
+        while (slots[slot]) slot = (slot + 1) & (uint32_t)(capacity - 1);
+        slots[slot] = item;
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+    index->tombstones = 0;
+    return true;
+}
+
+/*
+ * Adds item under its name; an existing entry with the same name is replaced
+ */
+bool dir_index_insert(dir_index *index, dir_item *item) {
+    /* Keep the load (tombstones included) under 3/4 */
+    if ((index->count + index->tombstones + 1) * 4 > index->capacity * 3) {
+        int32_t capacity = index->capacity ? index->capacity : DIR_INDEX_MIN_CAPACITY;
+        if ((index->count + 1) * 2 > capacity) capacity *= 2;
+        if (!rehash(index, capacity)) return false;
+    }
+
+    int32_t slot = find_slot(index, item->item_name);
+    if (!index->slots[slot]) index->count++;
+    index->slots[slot] = item;
+    return true;
+}
+
+dir_item *dir_index_find(const dir_index *index, const char *name) {
+    if (index->count == 0 || !name) return NULL;
+    return index->slots[find_slot(index, name)];
+}
+
+bool dir_index_remove(dir_index *index, const char *name) {
+    if (index->count == 0 || !name) return false;
+
+    int32_t slot = find_slot(index, name);
+    if (!index->slots[slot]) return false;
+
+    index->slots[slot] = &tombstone;
+    index->count--;
+    index->tombstones++;
+    return true;
+}
+
+void dir_index_free(dir_index *index) {
+    free(index->slots);
+    memset(index, 0, sizeof(dir_index));
+}
@@ -0,0 +1,11 @@
+#ifndef FS_ON_INODE_DIRINDEX_H
+#define FS_ON_INODE_DIRINDEX_H
+
+#include "structures.h"
+
+bool dir_index_insert(dir_index *index, dir_item *item);
+dir_item *dir_index_find(const dir_index *index, const char *name);
+bool dir_index_remove(dir_index *index, const char *name);
+void dir_index_free(dir_index *index);
+
+#endif //FS_ON_INODE_DIRINDEX_H
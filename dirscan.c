@@ -0,0 +1,145 @@
+#include <string.h>
+#include "dirscan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86
+#endif
+
+
+/*
+ * Scans of raw directory clusters. An entry is DIR_ENTRY_SIZE = 16 bytes, the
+ * inode followed by the zero-padded name, so a cluster is 256 aligned 16-byte
+ * lanes: SSE2 tests one entry per compare, AVX2 two (names) or eight (inodes
+ * through a gather). The variant is picked once, on first use, from the CPU;
+ * the scalar one is used everywhere else. An entry is in use when its inode is
+ * positive, like in load_directory_from_vfs().
+ */
+
+_Static_assert(DIR_ENTRY_SIZE == 16, "directory entries must fill 16-byte lanes");
+_Static_assert(MAX_DIR_ENTRIES_PER_CLUSTER % 8 == 0, "entries are scanned eight at a time");
+
+static void used_mask_scalar(const uint8_t *cluster, uint64_t *used) {
+    memset(used, 0, DIR_SLOT_WORDS * sizeof(uint64_t));
+    for (int32_t i = 0; i < MAX_DIR_ENTRIES_PER_CLUSTER; i++) {
+        int32_t node_id;
+        memcpy(&node_id, cluster + i * DIR_ENTRY_SIZE, sizeof(int32_t));
+        if (node_id > 0) used[i / BITMAP_WORD_BITS] |= 1ULL << (i % BITMAP_WORD_BITS);
+    }
+}
+
+static int32_t find_name_scalar(const uint8_t *cluster, const char *pattern) {
+    for (int32_t i = 0; i < MAX_DIR_ENTRIES_PER_CLUSTER; i++) {
+        const uint8_t *entry = cluster + i * DIR_ENTRY_SIZE;
+        int32_t node_id;
+        memcpy(&node_id, entry, sizeof(int32_t));
+        if (node_id > 0 && memcmp(entry + sizeof(int32_t), pattern, MAX_ITEM_NAME_LENGTH) == 0) return i;
+    }
+    return ID_ITEM_FREE;
+}
+
+#ifdef DIRSCAN_X86
+#ifdef __SSE2__
+static void used_mask_sse2(const uint8_t *cluster, uint64_t *used) {
+    const __m128i zero = _mm_setzero_si128();
+    memset(used, 0, DIR_SLOT_WORDS * sizeof(uint64_t));
+
+    for (int32_t i = 0; i < MAX_DIR_ENTRIES_PER_CLUSTER; i += 4) {
+        const float *base = (const float *)(cluster + i * DIR_ENTRY_SIZE);
+        /* Inodes of four entries into one vector */
+        __m128 low = _mm_shuffle_ps(_mm_loadu_ps(base), _mm_loadu_ps(base + 4), _MM_SHUFFLE(0, 0, 0, 0));
+        __m128 high = _mm_shuffle_ps(_mm_loadu_ps(base + 8), _mm_loadu_ps(base + 12), _MM_SHUFFLE(0, 0, 0, 0));
+        __m128i nodes = _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+
+        uint64_t bits = (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(nodes, zero)));
+        used[i / BITMAP_WORD_BITS] |= bits << (i % BITMAP_WORD_BITS);
+    }
+}
+
+static int32_t find_name_sse2(const uint8_t *cluster, const char *pattern) {
+    uint8_t lane[DIR_ENTRY_SIZE] = {0};
+    memcpy(lane + sizeof(int32_t), pattern, MAX_ITEM_NAME_LENGTH);
+    const __m128i wanted = _mm_loadu_si128((const __m128i *)lane);
+
+    for (int32_t i = 0; i < MAX_DIR_ENTRIES_PER_CLUSTER; i++) {
+        __m128i entry = _mm_loadu_si128((const __m128i *)(cluster + i * DIR_ENTRY_SIZE));
+        /* Name bytes must all match, the inode bytes are checked apart */
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(entry, wanted)) & 0xFFF0) != 0xFFF0) continue;
+        if (_mm_cvtsi128_si32(entry) > 0) return i;
+    }
+    return ID_ITEM_FREE;
+}
+#endif
+
+__attribute__((target("avx2")))
+static void used_mask_avx2(const uint8_t *cluster, uint64_t *used) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i offsets = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);    /* in int32, one per entry */
+    memset(used, 0, DIR_SLOT_WORDS * sizeof(uint64_t));
+
+    for (int32_t i = 0; i < MAX_DIR_ENTRIES_PER_CLUSTER; i += 8) {
+        __m256i nodes = _mm256_i32gather_epi32((const int *)(cluster + i * DIR_ENTRY_SIZE), offsets, 4);
+        uint64_t bits = (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(nodes, zero)));
+        used[i / BITMAP_WORD_BITS] |= bits << (i % BITMAP_WORD_BITS);
+    }
+}
+
+__attribute__((target("avx2")))
+static int32_t find_name_avx2(const uint8_t *cluster, const char *pattern) {
+    uint8_t lane[DIR_ENTRY_SIZE] = {0};
+    memcpy(lane + sizeof(int32_t), pattern, MAX_ITEM_NAME_LENGTH);
+    const __m256i wanted = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lane));
+
+    for (int32_t i = 0; i < MAX_DIR_ENTRIES_PER_CLUSTER; i += 2) {
+        __m256i pair = _mm256_loadu_si256((const __m256i *)(cluster + i * DIR_ENTRY_SIZE));
+        uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(pair, wanted));
+
+        for (int k = 0; k < 2; k++) {
+            if (((equal >> (k * DIR_ENTRY_SIZE)) & 0xFFF0) != 0xFFF0) continue;
+            int32_t node_id;
+            memcpy(&node_id, cluster + (i + k) * DIR_ENTRY_SIZE, sizeof(int32_t));
+            if (node_id > 0) return i + k;
+        }
+    }
+    return ID_ITEM_FREE;
+}
+#endif
+
+static void (*used_mask_impl)(const uint8_t *, uint64_t *);
+static int32_t (*find_name_impl)(const uint8_t *, const char *);
+
+static void dirscan_select(void) {
+    used_mask_impl = used_mask_scalar;
+    find_name_impl = find_name_scalar;
+#ifdef DIRSCAN_X86
+#ifdef __SSE2__
+    used_mask_impl = used_mask_sse2;
+    find_name_impl = find_name_sse2;
+#endif
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        used_mask_impl = used_mask_avx2;
+        find_name_impl = find_name_avx2;
+    }
+#endif
+}
+
+/*
+ * Sets one bit per entry of the cluster that is in use, DIR_SLOT_WORDS words
+ */
+void dirscan_used_mask(const uint8_t *cluster, uint64_t *used) {
+    if (!used_mask_impl) dirscan_select();
+    used_mask_impl(cluster, used);
+}
+
+/*
+ * Returns the entry in use holding name, compared on MAX_ITEM_NAME_LENGTH bytes
+ * like the name index, or ID_ITEM_FREE
+ */
+int32_t dirscan_find_name(const uint8_t *cluster, const char *name) {
+    char pattern[MAX_ITEM_NAME_LENGTH] = {0};
+    memcpy(pattern, name, strnlen(name, MAX_ITEM_NAME_LENGTH));
+
+    if (!find_name_impl) dirscan_select();
+    return find_name_impl(cluster, pattern);
+}
+
@@ -0,0 +1,9 @@
+#ifndef FS_ON_INODE_DIRSCAN_H
+#define FS_ON_INODE_DIRSCAN_H
+
+#include "structures.h"
+
+void dirscan_used_mask(const uint8_t *cluster, uint64_t *used);
+int32_t dirscan_find_name(const uint8_t *cluster, const char *name);
+
+#endif //FS_ON_INODE_DIRSCAN_H
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dirslots.h"
+
+
+/*
+ * Free entry map of one directory. Every data cluster of the directory has a bit
+ * per entry, so a new item goes straight to a free entry and a removed one is
+ * found without reading the cluster. Blocks are only looked up by cluster number,
+ * their order in the map does not follow the block map of the inode.
+ */
+
+static dir_slot_block *find_block(dir_slots *slots, int32_t cluster) {
+    for (int32_t i = 0; i < slots->count; i++) {
+        if (slots->blocks[i].cluster == cluster) return &slots->blocks[i];
+    }
+    return NULL;
+}
+
+/*
+ * Adds a directory cluster; used holds a bit per entry in use (see dirscan_used_mask()),
+ * NULL for a cluster with all entries free
+ */
+bool dir_slots_add_block(dir_slots *slots, int32_t cluster, const uint64_t *used) {
+    if (slots->count == slots->capacity) {
+        int32_t capacity = slots->capacity ? slots->capacity * 2 : 4;
+        dir_slot_block *grown = realloc(slots->blocks, capacity * sizeof(dir_slot_block));
+        if (!grown) return false;
+        slots->blocks = grown;
+        slots->capacity = capacity;
+    }
+
+    dir_slot_block *block = &slots->blocks[slots->count++];
+    memset(block, 0, sizeof(dir_slot_block));
+    block->cluster = cluster;
+    if (used) {
+        for (int w = 0; w < DIR_SLOT_WORDS; w++) {
+            block->bits[w] = used[w];
+            block->used += __builtin_popcountll(used[w]);
+        }
+    }
+    slots->free_count += MAX_DIR_ENTRIES_PER_CLUSTER - block->used;
+    return true;
+}
+
+/*
+ * Takes the first free entry, starting at the hint. Returns false when every
+ * cluster is full and the directory needs a new one.
+ */
+bool dir_slots_take(dir_slots *slots, int32_t *cluster, int32_t *slot) {
+    if (slots->free_count <= 0) return false;
+
+    for (int32_t i = slots->hint; i < slots->count; i++) {
+        dir_slot_block *block = &slots->blocks[i];
+        if (block->used == MAX_DIR_ENTRIES_PER_CLUSTER) continue;
+
+        for (int w = 0; w < DIR_SLOT_WORDS; w++) {
+            if (block->bits[w] == ~0ULL) continue;
+            int bit = __builtin_ctzll(~block->bits[w]);
+            block->bits[w] |= 1ULL << bit;
+            block->used++;
+            slots->free_count--;
+            slots->hint = i;
+            *cluster = block->cluster;
+            *slot = w * BITMAP_WORD_BITS + bit;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Frees an entry, returns the number of entries still used in its cluster or -1
+ * when the entry is not in the map
+ */
+int32_t dir_slots_release(dir_slots *slots, int32_t cluster, int32_t slot) {
+    dir_slot_block *block = find_block(slots, cluster);
+    if (!block || slot < 0 || slot >= MAX_DIR_ENTRIES_PER_CLUSTER) return -1;
+
+    uint64_t mask = 1ULL << (slot % BITMAP_WORD_BITS);
+    if (!(block->bits[slot / BITMAP_WORD_BITS] & mask)) return -1;
+    block->bits[slot / BITMAP_WORD_BITS] &= ~mask;
+    block->used--;
+    slots->free_count++;
+
+    int32_t index = (int32_t)(block - slots->blocks);
+    if (index < slots->hint) slots->hint = index;
+    return block->used;
+}
+
+/*
+ * Forgets a cluster that was released from the directory; its entries must be free
+ */
+void dir_slots_drop_block(dir_slots *slots, int32_t cluster) {
+    dir_slot_block *block = find_block(slots, cluster);
+    if (!block) return;
+
+    slots->free_count -= MAX_DIR_ENTRIES_PER_CLUSTER - block->used;
+    *block = slots->blocks[--slots->count];
+    slots->hint = 0;
+}
+
+void dir_slots_free(dir_slots *slots) {
+    free(slots->blocks);
+    memset(slots, 0, sizeof(dir_slots));
+}
@@ -0,0 +1,12 @@
+#ifndef FS_ON_INODE_DIRSLOTS_H
+#define FS_ON_INODE_DIRSLOTS_H
+
+#include "structures.h"
+
+bool dir_slots_add_block(dir_slots *slots, int32_t cluster, const uint64_t *used);
+bool dir_slots_take(dir_slots *slots, int32_t *cluster, int32_t *slot);
+int32_t dir_slots_release(dir_slots *slots, int32_t cluster, int32_t slot);
+void dir_slots_drop_block(dir_slots *slots, int32_t cluster);
+void dir_slots_free(dir_slots *slots);
+
+#endif //FS_ON_INODE_DIRSLOTS_H
@@ -0,0 +1,961 @@
+#define _GNU_SOURCE     /* copy_file_range() */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include "fileio.h"
+#include "vfs.h"
+#include "cache.h"
+#include "helpers.h"
+#include "blockmap.h"
+#include "compress.h"
+#include "dedup.h"
+
+
+/*
+ * File data transfer between the host and the image. Data clusters are moved in
+ * IO_CHUNK_CLUSTERS chunks straight to or from the image, one write per run of
+ * neighbouring clusters, bypassing the cluster cache; inode, bitmap and directory
+ * changes only go to memory and reach the image on the next vfs_commit().
+ */
+
+/*
+ * Reads up to size bytes, stopping early only at the end of the file. Returns -1 on error.
+ */
+static ssize_t read_full(int fd, uint8_t *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buffer + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+/*
+ * Writes count whole clusters from data to the given data blocks, one positional
+ * write per run of neighbouring blocks. The stdio stream is not touched, see
+ * vfs_pwrite_direct().
+ */
+static bool write_runs(VFS **vfs, const int32_t *blocks, int32_t count, const uint8_t *data) {
+    for (int32_t i = 0; i < count; ) {
+        int32_t run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run) run++;
+
+        size_t bytes = (size_t)run * CLUSTER_SIZE;
+        if (vfs_pwrite_direct(vfs, data + (size_t)i * CLUSTER_SIZE, bytes, vfs_cluster_offset(vfs, blocks[i])) != bytes) {
+            return false;
+        }
+        i += run;
+    }
+    return true;
+}
+
+/*
+ * Same as write_runs(), cached copies of the blocks are dropped first
+ */
+bool file_write_clusters(VFS **vfs, const int32_t *blocks, int32_t count, const uint8_t *data) {
+    for (int32_t i = 0; i < count; i++) cache_invalidate(vfs, blocks[i]);
+    vfs_sync_stream(vfs);
+    return write_runs(vfs, blocks, count, data);
+}
+
+/*
+ * Where file_create() takes the data from: fills buffer with up to size bytes and
+ * returns how many were read, fewer only at the end of the data, or -1 on error
+ */
+typedef ssize_t (*file_source)(VFS **vfs, void *source, uint8_t *buffer, size_t size);
+
+static ssize_t host_source(VFS **vfs, void *source, uint8_t *buffer, size_t size) {
+    (void)vfs;
+    return read_full(*(int *)source, buffer, size);
+}
+
+/*
+ * Reads a file of the image run by run, straight from the image file. The run
+ * after the one being read is always known and already requested from the kernel,
+ * so the jump to it does not stall on a cold read. Compressed files are decoded
+ * one group at a time.
+ */
+typedef struct IMAGE_SOURCE {
+    block_iter it;
+    extent run;
+    int32_t run_done;                   // clusters of run already read
+    extent next;                        // run after it, valid when has_next
+    bool has_next;
+    uint32_t *lengths;                  // stored size of every group of a compressed file, else NULL
+    int32_t group;                      // next group to decode
+    int32_t group_count;
+    int64_t size;
+    uint8_t *stored;                    // COMPRESS_GROUP_SIZE bytes each
+    uint8_t *plain;
+    int32_t plain_size;                 // bytes of the decoded group, plain_done of them handed out
+    int32_t plain_done;
+} image_source;
+
+/*
+ * Takes the following run from the block map and starts reading up to
+ * READAHEAD_CLUSTERS of it in the background
+ */
+static bool image_prefetch(VFS **vfs, image_source *src) {
+    if (!block_iter_next_run(vfs, &src->it, &src->next)) return false;
+
+    int32_t count = src->next.length < READAHEAD_CLUSTERS ? src->next.length : READAHEAD_CLUSTERS;
+    long offset = vfs_cluster_offset(vfs, src->next.start);
+    size_t bytes = (size_t)count * CLUSTER_SIZE;
+    if ((*vfs)->map) {
+        if ((size_t)offset + bytes <= (*vfs)->map_size) madvise((*vfs)->map + offset, bytes, MADV_WILLNEED);
+    } else {
+        posix_fadvise(fileno((*vfs)->vfs_file), offset, (off_t)bytes, POSIX_FADV_WILLNEED);
+    }
+    return true;
+}
+
+/*
+ * Reads the clusters of the file as they are stored
+ */
+static ssize_t read_stored(VFS **vfs, image_source *src, uint8_t *buffer, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        if (src->run_done == src->run.length) {
+            if (!src->has_next) {
+                /* Past the end of the map: the rest of the file is a hole */
+                memset(buffer + done, 0, size - done);
+                done = size;
+                break;
+            }
+            src->run = src->next;
+            src->run_done = 0;
+            src->has_next = image_prefetch(vfs, src);
+        }
+        int32_t n = src->run.length - src->run_done;
+        int32_t wanted = (int32_t)((size - done + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+        if (n > wanted) n = wanted;
+        size_t bytes = (size_t)n * CLUSTER_SIZE;
+        if (bytes > size - done) bytes = size - done;
+
+        long offset = vfs_cluster_offset(vfs, src->run.start + src->run_done);
+        if ((*vfs)->map) {
+            memcpy(buffer + done, (*vfs)->map + offset, bytes);
+        } else {
+            ssize_t got = pread(fileno((*vfs)->vfs_file), buffer + done, bytes, offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) return -1;
+            if ((size_t)got < bytes) {
+                /* Clusters never written are past the end of the image file */
+                memset(buffer + done + got, 0, bytes - (size_t)got);
+            }
+        }
+        done += bytes;
+        src->run_done += n;
+    }
+    return (ssize_t)done;
+}
+
+static void image_source_free(image_source *src) {
+    free(src->lengths);
+    free(src->stored);
+    free(src->plain);
+    src->lengths = NULL;
+    src->stored = src->plain = NULL;
+}
+
+/*
+ * Starts reading file inode id; for a compressed file its group lengths are loaded
+ */
+static bool image_source_init(VFS **vfs, image_source *src, int32_t id) {
+    memset(src, 0, sizeof(*src));
+    block_iter_init(vfs, &src->it, id);
+    src->has_next = image_prefetch(vfs, src);
+
+    inode *node = &(*vfs)->inodes[id];
+    if (!(node->flags & INODE_FLAG_COMPRESSED)) return true;
+
+    size_t header = (size_t)compress_header_count(node->file_size) * CLUSTER_SIZE;
+    src->size = node->file_size;
+    src->group_count = compress_group_count(src->size);
+    src->lengths = malloc(header);
+    src->stored = malloc(COMPRESS_GROUP_SIZE);
+    src->plain = malloc(COMPRESS_GROUP_SIZE);
+    if (!src->lengths || !src->stored || !src->plain ||
+        read_stored(vfs, src, (uint8_t *)src->lengths, header) != (ssize_t)header) {
+        image_source_free(src);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Decodes the next group of a compressed file into src->plain
+ */
+static bool next_group(VFS **vfs, image_source *src) {
+    int64_t left = src->size - (int64_t)src->group * COMPRESS_GROUP_SIZE;
+    int32_t plain = left < COMPRESS_GROUP_SIZE ? (int32_t)left : COMPRESS_GROUP_SIZE;
+    uint32_t length = src->lengths[src->group++];
+    if (length == 0 || length > (uint32_t)plain) return false;
+
+    /* A group stored as it is goes straight to the plain buffer */
+    size_t stored = (length + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+    uint8_t *target = length == (uint32_t)plain ? src->plain : src->stored;
+    if (read_stored(vfs, src, target, stored) != (ssize_t)stored) return false;
+    if (target == src->stored && lz_decompress(src->stored, (int)length, src->plain, plain) != plain) return false;
+
+    src->plain_size = plain;
+    src->plain_done = 0;
+    return true;
+}
+
+static ssize_t image_read(VFS **vfs, void *source, uint8_t *buffer, size_t size) {
+    image_source *src = source;
+    if (!src->lengths) return read_stored(vfs, src, buffer, size);
+
+    size_t done = 0;
+    while (done < size) {
+        if (src->plain_done == src->plain_size) {
+            if (src->group == src->group_count) break;
+            if (!next_group(vfs, src)) return -1;
+        }
+        size_t n = (size_t)(src->plain_size - src->plain_done);
+        if (n > size - done) n = size - done;
+        memcpy(buffer + done, src->plain + src->plain_done, n);
+        src->plain_done += (int32_t)n;
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+/*
+ * Takes the inode and all clusters (data first, then the indirect ones) for a file
+ * of size bytes, as contiguous as the bitmap allows, and builds its block map in
+ * memory. Everything is marked used right away so reservations made before the
+ * data arrives do not overlap. A file of at most INLINE_DATA_SIZE bytes takes no
+ * cluster, its data goes into the inode. A compressed one takes its header and
+ * as many clusters as uncompressed; those compression saves are given back by
+ * file_finish(). options are STORE_* flags. Prints the reason and returns false
+ * on failure.
+ */
+bool file_reserve(VFS **vfs, int64_t size, int options, file_reservation *res) {
+    memset(res, 0, sizeof(*res));
+    int64_t data_count64 = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (size > INT32_MAX || data_count64 > MAX_FILE_BLOCKS) {
+        printf(FILE_TOO_LARGE_MSG);
+        return false;
+    }
+
+    res->size = size;
+    res->inline_data = size > 0 && size <= INLINE_DATA_SIZE && vfs_inline_enabled(vfs);
+    res->compressed = (options & STORE_COMPRESSED) && !res->inline_data && data_count64 > 1 &&
+                      data_count64 + compress_header_count(size) <= MAX_FILE_BLOCKS;
+    res->data_count = res->inline_data ? 0 : (int32_t)data_count64;
+    if (res->compressed) res->data_count += compress_header_count(size);
+    res->meta_count = blockmap_meta_count(res->data_count);
+    int32_t total = res->data_count + res->meta_count;
+
+    res->id = vfs_alloc_inode(vfs);
+    if (res->id == ID_ITEM_FREE) {
+        printf(NO_FREE_INODE);
+        return false;
+    }
+
+    if (total > 0) {
+        res->blocks = find_free_data_blocks(vfs, total);
+        if (!res->blocks) {
+            inode_bitmap_set(vfs, res->id, false);
+            printf(NOT_ENOUGH_BLOCKS_MSG);
+            return false;
+        }
+    }
+    bool dedup = (options & STORE_DEDUP) && !res->compressed && res->data_count > 0 && (*vfs)->dedup_index;
+    if ((res->meta_count > 0 && !(res->meta_data = calloc(res->meta_count, CLUSTER_SIZE))) ||
+        (dedup && !(res->hashes = malloc((size_t)res->data_count * sizeof(uint64_t))))) {
+        free(res->meta_data);
+        free(res->blocks);
+        inode_bitmap_set(vfs, res->id, false);
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+
+    inode *node = &(*vfs)->inodes[res->id];
+    memset(node, 0, sizeof(inode));
+    node->nodeid = res->id;
+    node->isDirectory = false;
+    node->references = 1;
+    node->file_size = (int32_t)size;
+    if (res->inline_data) {
+        node->flags = INODE_FLAG_INLINE;
+    } else {
+        blockmap_build(node, res->blocks, res->data_count, res->blocks + res->data_count, res->meta_data);
+    }
+
+    /* The clusters are written without the cache, stale copies must not outlive them */
+    for (int32_t i = 0; i < total; i++) {
+        bitmap_set(vfs, res->blocks[i], true);
+        cache_invalidate(vfs, res->blocks[i]);
+    }
+    return true;
+}
+
+static bool stream_plain(VFS **vfs, file_reservation *res, file_source fill, void *source) {
+    int32_t chunk = res->data_count < IO_CHUNK_CLUSTERS ? res->data_count : IO_CHUNK_CLUSTERS;
+    uint8_t *buffer = NULL;
+    if (chunk > 0 && posix_memalign((void **)&buffer, CLUSTER_SIZE, (size_t)chunk * CLUSTER_SIZE) != 0) {
+        return false;
+    }
+
+    bool ok = true;
+    for (int32_t done = 0; ok && done < res->data_count; ) {
+        int32_t n = res->data_count - done < chunk ? res->data_count - done : chunk;
+        size_t wanted = (size_t)n * CLUSTER_SIZE;
+        int64_t offset = (int64_t)done * CLUSTER_SIZE;
+        if (offset + (int64_t)wanted > res->size) wanted = (size_t)(res->size - offset);
+
+        ssize_t got = fill(vfs, source, buffer, wanted);
+        if (got < 0) {
+            ok = false;
+            break;
+        }
+        /* The tail of the last cluster (or of a file that shrank meanwhile) is zeroed */
+        memset(buffer + got, 0, (size_t)n * CLUSTER_SIZE - (size_t)got);
+        for (int32_t i = 0; res->hashes && i < n; i++) {
+            res->hashes[done + i] = dedup_hash(buffer + (size_t)i * CLUSTER_SIZE);
+        }
+        ok = write_runs(vfs, res->blocks + done, n, buffer);
+        done += n;
+    }
+
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Keeps count data blocks of a reservation from first on and the indirect
+ * clusters they need, the other clusters become spare ones. The indirect
+ * clusters are laid out again for the kept blocks.
+ */
+static bool reservation_trim(file_reservation *res, int32_t first, int32_t count) {
+    int32_t total = res->data_count + res->meta_count;
+    int32_t meta_count = blockmap_meta_count(count);
+    const int32_t *meta = res->blocks + res->data_count;
+    int32_t *blocks = malloc((size_t)total * sizeof(int32_t));
+    if (!blocks) return false;
+
+    int32_t n = 0;
+    for (int32_t i = first; i < first + count; i++) blocks[n++] = res->blocks[i];
+    for (int32_t i = 0; i < meta_count; i++) blocks[n++] = meta[i];
+    for (int32_t i = 0; i < first; i++) blocks[n++] = res->blocks[i];
+    for (int32_t i = first + count; i < res->data_count; i++) blocks[n++] = res->blocks[i];
+    for (int32_t i = meta_count; i < res->meta_count; i++) blocks[n++] = meta[i];
+
+    free(res->blocks);
+    res->blocks = blocks;
+    res->data_count = count;
+    res->meta_count = meta_count;
+    res->spare_count = total - count - meta_count;
+
+    inode layout;
+    if (meta_count > 0) memset(res->meta_data, 0, (size_t)meta_count * CLUSTER_SIZE);
+    blockmap_build(&layout, blocks, count, blocks + count, res->meta_data);
+    return true;
+}
+
+/*
+ * Streams a compressed reservation: every group goes right after the previous
+ * one, compressed when that saves a cluster and as it is otherwise, and the
+ * group lengths are written to the header. When no group shrank the header is
+ * dropped and the file is left uncompressed.
+ */
+static bool stream_compressed(VFS **vfs, file_reservation *res, file_source fill, void *source) {
+    int32_t header = compress_header_count(res->size);
+    size_t chunk = (size_t)IO_CHUNK_CLUSTERS * CLUSTER_SIZE;
+    uint32_t *lengths = calloc(header, CLUSTER_SIZE);
+    uint8_t *buffer = NULL, *packed = NULL;
+    if (!lengths || posix_memalign((void **)&buffer, CLUSTER_SIZE, chunk) != 0 ||
+        posix_memalign((void **)&packed, CLUSTER_SIZE, chunk) != 0) {
+        free(lengths);
+        free(buffer);
+        return false;
+    }
+
+    bool ok = true, shrank = false;
+    int32_t next = header, group = 0;
+    for (int64_t offset = 0; ok && offset < res->size; offset += (int64_t)chunk) {
+        size_t wanted = res->size - offset < (int64_t)chunk ? (size_t)(res->size - offset) : chunk;
+        ssize_t got = fill(vfs, source, buffer, wanted);
+        if (got < 0) {
+            ok = false;
+            break;
+        }
+        memset(buffer + got, 0, wanted - (size_t)got);
+
+        size_t used = 0;
+        for (size_t at = 0; at < wanted; at += COMPRESS_GROUP_SIZE) {
+            int plain = wanted - at < COMPRESS_GROUP_SIZE ? (int)(wanted - at) : COMPRESS_GROUP_SIZE;
+            int clusters = (plain + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+            int length = lz_compress(buffer + at, plain, packed + used, (clusters - 1) * CLUSTER_SIZE);
+            if (length > 0) {
+                shrank = true;
+            } else {
+                memcpy(packed + used, buffer + at, plain);
+                length = plain;
+            }
+            lengths[group++] = (uint32_t)length;
+
+            int stored = (length + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+            memset(packed + used + length, 0, stored - length);
+            used += stored;
+        }
+        ok = write_runs(vfs, res->blocks + next, (int32_t)(used / CLUSTER_SIZE), packed);
+        next += (int32_t)(used / CLUSTER_SIZE);
+    }
+    if (ok && shrank) ok = write_runs(vfs, res->blocks, header, (uint8_t *)lengths);
+
+    free(lengths);
+    free(buffer);
+    free(packed);
+    if (!ok) return false;
+
+    res->compressed = shrank;
+    return shrank ? reservation_trim(res, 0, next) : reservation_trim(res, header, next - header);
+}
+
+/*
+ * Streams the data of a reservation from fill in chunks and writes its indirect
+ * clusters. Only the reserved clusters are written, no shared structure (nor the
+ * stdio stream) is touched, so reservations can be filled in parallel.
+ */
+static bool file_stream(VFS **vfs, file_reservation *res, file_source fill, void *source) {
+    if (res->inline_data) {
+        /* Kept in the reservation, the inode itself is only touched by file_finish() */
+        return fill(vfs, source, res->inline_bytes, (size_t)res->size) >= 0;
+    }
+
+    bool ok = res->compressed ? stream_compressed(vfs, res, fill, source) : stream_plain(vfs, res, fill, source);
+    if (ok && res->meta_count > 0) {
+        ok = write_runs(vfs, res->blocks + res->data_count, res->meta_count, res->meta_data);
+    }
+    return ok;
+}
+
+/*
+ * Fills a reservation with the contents of fd, see file_stream()
+ */
+bool file_fill(VFS **vfs, file_reservation *res, int fd) {
+    return file_stream(vfs, res, host_source, &fd);
+}
+
+/*
+ * Ends a reservation: a filled one becomes a file whose inode is written on the
+ * next commit, otherwise its clusters and inode are given back. Spare clusters
+ * are given back in both cases. The blocks of a deduplicated file are shared
+ * with identical indexed clusters here. Returns the inode or ID_ITEM_FREE.
+ */
+int32_t file_finish(VFS **vfs, file_reservation *res, bool filled) {
+    int32_t id = res->id;
+    int32_t kept = filled ? res->data_count + res->meta_count : 0;
+    for (int32_t i = kept; i < res->data_count + res->meta_count + res->spare_count; i++) {
+        bitmap_set(vfs, res->blocks[i], false);
+    }
+
+    if (filled) {
+        inode *node = &(*vfs)->inodes[id];
+        if (res->inline_data) memcpy(inode_inline_data(node), res->inline_bytes, INLINE_DATA_SIZE);
+        if (res->spare_count > 0) {
+            blockmap_build(node, res->blocks, res->data_count, res->blocks + res->data_count, res->meta_data);
+        }
+        if (res->compressed) node->flags |= INODE_FLAG_COMPRESSED;
+        write_inode_to_vfs(vfs, id);
+        if (res->hashes) dedup_file(vfs, id, res->blocks, res->data_count, res->hashes);
+    } else {
+        vfs_free_inode(vfs, id);
+        id = ID_ITEM_FREE;
+    }
+
+    free(res->blocks);
+    free(res->meta_data);
+    free(res->hashes);
+    memset(res, 0, sizeof(*res));
+    return id;
+}
+
+/*
+ * Creates a file inode of size bytes filled from fill, stored as options
+ * (STORE_*) ask. Returns the inode, or ID_ITEM_FREE after printing the reason;
+ * nothing is kept on failure.
+ */
+static int32_t file_create(VFS **vfs, int64_t size, int options, file_source fill, void *source) {
+    file_reservation res;
+    if (!file_reserve(vfs, size, options, &res)) return ID_ITEM_FREE;
+
+    vfs_sync_stream(vfs);
+    int32_t id = file_finish(vfs, &res, file_stream(vfs, &res, fill, source));
+    if (id == ID_ITEM_FREE) printf(FILE_NOT_FOUND_MSG);
+    return id;
+}
+
+/*
+ * Copies size bytes from fd into a new file inode, see file_create()
+ */
+int32_t file_import(VFS **vfs, int fd, int64_t size, int options) {
+    return file_create(vfs, size, options, host_source, &fd);
+}
+
+/*
+ * Creates a file inode sharing the data clusters of source: only the indirect
+ * clusters are new, every data cluster gets one more owner. Returns ID_ITEM_FREE
+ * without printing anything when the clusters cannot be shared.
+ */
+static int32_t file_clone(VFS **vfs, int32_t source) {
+    if (!(*vfs)->refcounts) return ID_ITEM_FREE;
+
+    block_map *map = blockmap_get(vfs, source);
+    if (!map) return ID_ITEM_FREE;
+    for (int32_t i = 0; i < map->count; i++) {
+        if (refcount_get(vfs, map->blocks[i]) > MAX_CLUSTER_SHARES) return ID_ITEM_FREE;
+    }
+
+    int32_t meta_count = blockmap_meta_count(map->count);
+    int32_t *meta = NULL;
+    uint8_t *meta_data = NULL;
+    if (meta_count > 0) {
+        meta = find_free_data_blocks(vfs, meta_count);
+        meta_data = calloc(meta_count, CLUSTER_SIZE);
+        if (!meta || !meta_data) {
+            free(meta);
+            free(meta_data);
+            return ID_ITEM_FREE;
+        }
+    }
+
+    int32_t id = vfs_alloc_inode(vfs);
+    if (id == ID_ITEM_FREE) {
+        free(meta);
+        free(meta_data);
+        return ID_ITEM_FREE;
+    }
+
+    inode *node = &(*vfs)->inodes[id];
+    memset(node, 0, sizeof(inode));
+    node->nodeid = id;
+    node->isDirectory = false;
+    node->references = 1;
+    node->file_size = (*vfs)->inodes[source].file_size;
+    node->flags = (*vfs)->inodes[source].flags & INODE_FLAG_COMPRESSED;
+    blockmap_build(node, map->blocks, map->count, meta, meta_data);
+    if (meta_count > 0 && !file_write_clusters(vfs, meta, meta_count, meta_data)) {
+        vfs_free_inode(vfs, id);
+        free(meta);
+        free(meta_data);
+        return ID_ITEM_FREE;
+    }
+
+    for (int32_t i = 0; i < map->count; i++) refcount_share(vfs, map->blocks[i]);
+    for (int32_t i = 0; i < meta_count; i++) bitmap_set(vfs, meta[i], true);
+    write_inode_to_vfs(vfs, id);
+
+    free(meta);
+    free(meta_data);
+    return id;
+}
+
+/*
+ * Copies file inode source into a new file inode. The data clusters are shared
+ * when the volume keeps reference counts, otherwise (or when a cluster has too
+ * many owners) the data is read back and written to new clusters, compressed
+ * when the source is or the volume compresses new files; inline data is simply
+ * copied. Returns the inode, or ID_ITEM_FREE after printing the reason.
+ */
+int32_t file_copy(VFS **vfs, int32_t source) {
+    inode *node = &(*vfs)->inodes[source];
+    if (node->flags & INODE_FLAG_INLINE) {
+        file_reservation res;
+        if (!file_reserve(vfs, node->file_size, 0, &res)) return ID_ITEM_FREE;
+        memcpy(res.inline_bytes, inode_inline_data(node), INLINE_DATA_SIZE);
+        return file_finish(vfs, &res, true);
+    }
+
+    int32_t id = file_clone(vfs, source);
+    if (id != ID_ITEM_FREE) return id;
+
+    /* The image file is read directly, cached clusters must be there first */
+    flush_vfs(vfs);
+
+    image_source src;
+    if (!image_source_init(vfs, &src, source)) {
+        printf(MEMORY_ERROR_MSG);
+        return ID_ITEM_FREE;
+    }
+    bool compress = (node->flags & INODE_FLAG_COMPRESSED) || vfs_compress_enabled(vfs);
+    id = file_create(vfs, node->file_size, compress ? STORE_COMPRESSED : 0, image_read, &src);
+    image_source_free(&src);
+    return id;
+}
+
+/*
+ * Writes the contents of file inode id to out. Whole runs of clusters are read
+ * IO_CHUNK_CLUSTERS at a time while the next run is prefetched, and every chunk
+ * goes to out in one write.
+ */
+bool file_print(VFS **vfs, int32_t id, FILE *out) {
+    int64_t left = (*vfs)->inodes[id].file_size;
+    if (left == 0) return true;
+    if ((*vfs)->inodes[id].flags & INODE_FLAG_INLINE) {
+        return fwrite(inode_inline_data(&(*vfs)->inodes[id]), 1, (size_t)left, out) == (size_t)left;
+    }
+
+    size_t chunk = (size_t)IO_CHUNK_CLUSTERS * CLUSTER_SIZE;
+    uint8_t *buffer = malloc(chunk);
+    if (!buffer) return false;
+
+    /* The image file is read directly, cached clusters must be there first */
+    flush_vfs(vfs);
+
+    image_source src;
+    bool ok = image_source_init(vfs, &src, id);
+    while (ok && left > 0) {
+        size_t wanted = left < (int64_t)chunk ? (size_t)left : chunk;
+        ssize_t got = image_read(vfs, &src, buffer, wanted);
+        ok = got > 0 && fwrite(buffer, 1, (size_t)got, out) == (size_t)got;
+        left -= got;
+    }
+
+    image_source_free(&src);
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Links new file inode id into dir under name, releasing the file when that fails
+ */
+bool file_link(VFS **vfs, directory *dir, char *name, int32_t id) {
+    dir_item *item = create_directory_item(vfs, id, name);
+    if (!item || !directory_add_item(dir, item, false)) {
+        free_directory_item(vfs, item);
+        file_release(vfs, id);
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+
+    if (update_directory_in_file(vfs, dir, item, true) == ERROR_CODE) {
+        directory_remove_item(dir, item->item_name, false);
+        free_directory_item(vfs, item);
+        file_release(vfs, id);
+        printf(NOT_ENOUGH_BLOCKS_MSG);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Frees the data and indirect clusters of a file inode and the inode itself. Data
+ * clusters shared with other files only lose this owner.
+ */
+void file_release(VFS **vfs, int32_t id) {
+    inode *node = &(*vfs)->inodes[id];
+    block_iter it;
+    int32_t block;
+
+    if (node->flags & INODE_FLAG_INLINE) {
+        vfs_free_inode(vfs, id);
+        return;
+    }
+
+    block_iter_init(vfs, &it, id);
+    while (block_iter_next(vfs, &it, &block)) {
+        refcount_release(vfs, block);
+    }
+
+    if (node->indirect1 != ID_ITEM_FREE) bitmap_set(vfs, node->indirect1, false);
+    if (node->indirect2 != ID_ITEM_FREE) {
+        int32_t *outer = (int32_t *) cache_get_cluster(vfs, node->indirect2);
+        for (int i = 0; outer && i < INT32_COUNT_IN_BLOCK; i++) {
+            if (outer[i] > 0) bitmap_set(vfs, outer[i], false);
+        }
+        bitmap_set(vfs, node->indirect2, false);
+    }
+
+    vfs_free_inode(vfs, id);
+}
+
+/*
+ * Copies length bytes of the image at *in_offset to out_fd at *out_offset, letting
+ * the kernel move them: copy_file_range(), then sendfile(), then pread()/pwrite()
+ * through a bounce buffer when neither is supported between the two files
+ */
+static bool copy_image_range(VFS **vfs, int out_fd, off_t *in_offset, off_t *out_offset, size_t length) {
+    int in_fd = fileno((*vfs)->vfs_file);
+    static bool no_copy_range, no_sendfile;
+
+    while (length > 0 && !no_copy_range) {
+        ssize_t n = copy_file_range(in_fd, in_offset, out_fd, out_offset, length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            no_copy_range = true;
+            break;
+        }
+        if (n <= 0) return false;
+        length -= (size_t)n;
+    }
+
+    /* sendfile() writes at the current position of out_fd */
+    while (length > 0 && !no_sendfile) {
+        if (lseek(out_fd, *out_offset, SEEK_SET) < 0) return false;
+        ssize_t n = sendfile(out_fd, in_fd, in_offset, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+            no_sendfile = true;
+            break;
+        }
+        if (n <= 0) return false;
+        *out_offset += n;
+        length -= (size_t)n;
+    }
+
+    if (length == 0) return true;
+
+    uint8_t *buffer = malloc((size_t)IO_CHUNK_CLUSTERS * CLUSTER_SIZE);
+    if (!buffer) return false;
+    while (length > 0) {
+        size_t chunk = length < (size_t)IO_CHUNK_CLUSTERS * CLUSTER_SIZE ? length : (size_t)IO_CHUNK_CLUSTERS * CLUSTER_SIZE;
+        ssize_t got = pread(in_fd, buffer, chunk, *in_offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || pwrite(out_fd, buffer, (size_t)got, *out_offset) != got) {
+            free(buffer);
+            return false;
+        }
+        *in_offset += got;
+        *out_offset += got;
+        length -= (size_t)got;
+    }
+    free(buffer);
+    return true;
+}
+
+/*
+ * Writes the decoded contents of compressed file inode id to fd in chunks
+ */
+static bool export_compressed(VFS **vfs, int32_t id, int fd) {
+    int64_t size = (*vfs)->inodes[id].file_size;
+    size_t chunk = (size_t)IO_CHUNK_CLUSTERS * CLUSTER_SIZE;
+    uint8_t *buffer = malloc(chunk);
+    if (!buffer) return false;
+
+    flush_vfs(vfs);
+
+    image_source src;
+    bool ok = image_source_init(vfs, &src, id);
+    for (int64_t offset = 0; ok && offset < size; offset += (int64_t)chunk) {
+        size_t wanted = size - offset < (int64_t)chunk ? (size_t)(size - offset) : chunk;
+        ok = image_read(vfs, &src, buffer, wanted) == (ssize_t)wanted &&
+             pwrite(fd, buffer, wanted, offset) == (ssize_t)wanted;
+    }
+
+    image_source_free(&src);
+    free(buffer);
+    return ok && ftruncate(fd, size) == 0;
+}
+
+/*
+ * Writes the contents of file inode id to fd. The block map is walked as runs of
+ * neighbouring clusters and each run is copied by the kernel in one go, the last
+ * one trimmed to file_size. A hole at the end stays a hole in fd.
+ */
+bool file_export(VFS **vfs, int32_t id, int fd) {
+    int64_t left = (*vfs)->inodes[id].file_size;
+    off_t out_offset = 0;
+    block_iter it;
+    extent run;
+
+    if ((*vfs)->inodes[id].flags & INODE_FLAG_INLINE) {
+        return pwrite(fd, inode_inline_data(&(*vfs)->inodes[id]), (size_t)left, 0) == left && ftruncate(fd, left) == 0;
+    }
+    if ((*vfs)->inodes[id].flags & INODE_FLAG_COMPRESSED) return export_compressed(vfs, id, fd);
+
+    /* The kernel reads the image file, cached clusters must be there first */
+    flush_vfs(vfs);
+
+    block_iter_init(vfs, &it, id);
+    while (left > 0 && block_iter_next_run(vfs, &it, &run)) {
+        int64_t bytes = (int64_t)run.length * CLUSTER_SIZE;
+        if (bytes > left) bytes = left;
+
+        off_t in_offset = vfs_cluster_offset(vfs, run.start);
+        if (!copy_image_range(vfs, fd, &in_offset, &out_offset, (size_t)bytes)) return false;
+        left -= bytes;
+    }
+
+    return ftruncate(fd, out_offset + (off_t)left) == 0;
+}
+
+/*
+ * Clears the bytes of file block pos from offset on. A block shared with other
+ * files is copied first, the file gets the copy.
+ */
+static bool clear_block_tail(VFS **vfs, int32_t id, int32_t pos, int32_t block, int32_t offset) {
+    if (refcount_get(vfs, block) == 1) {
+        uint8_t *data = cache_get_cluster(vfs, block);
+        if (!data) return false;
+        dedup_forget(vfs, block);
+        memset(data + offset, 0, CLUSTER_SIZE - offset);
+        cache_mark_dirty(vfs, block);
+        return true;
+    }
+
+    uint8_t data[CLUSTER_SIZE];
+    int32_t *copy = find_free_data_blocks(vfs, 1);
+    if (!copy) {
+        printf(NOT_ENOUGH_BLOCKS_MSG);
+        return false;
+    }
+    bool ok = cache_read(vfs, block, 0, data, offset) && cache_zero_cluster(vfs, *copy) &&
+              cache_write(vfs, *copy, 0, data, offset) && blockmap_set(vfs, id, pos, *copy);
+    if (ok) {
+        bitmap_set(vfs, *copy, true);
+        refcount_release(vfs, block);
+    } else {
+        cache_invalidate(vfs, *copy);
+    }
+    free(copy);
+    return ok;
+}
+
+/*
+ * Moves the contents of inline file inode id to a data cluster of its own
+ */
+static bool inline_promote(VFS **vfs, int32_t id) {
+    inode *node = &(*vfs)->inodes[id];
+    uint8_t data[INLINE_DATA_SIZE];
+    int32_t *block = find_free_data_blocks(vfs, 1);
+    if (!block) {
+        printf(NOT_ENOUGH_BLOCKS_MSG);
+        return false;
+    }
+
+    memcpy(data, inode_inline_data(node), INLINE_DATA_SIZE);
+    if (!cache_zero_cluster(vfs, *block) || !cache_write(vfs, *block, 0, data, INLINE_DATA_SIZE)) {
+        cache_invalidate(vfs, *block);
+        free(block);
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+
+    bitmap_set(vfs, *block, true);
+    node->flags &= ~INODE_FLAG_INLINE;
+    blockmap_build(node, block, 1, NULL, NULL);
+    write_inode_to_vfs(vfs, id);
+    free(block);
+    return true;
+}
+
+/*
+ * Moves the first size bytes (at most INLINE_DATA_SIZE) of file inode id into the
+ * inode and releases all its clusters
+ */
+static bool inline_demote(VFS **vfs, int32_t id, int32_t size) {
+    uint8_t data[INLINE_DATA_SIZE] = {0};
+    block_map *map = blockmap_get(vfs, id);
+    if (!map || (map->count > 0 && !cache_read(vfs, map->blocks[0], 0, data, size)) ||
+        !blockmap_truncate(vfs, id, 0)) {
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+
+    inode *node = &(*vfs)->inodes[id];
+    node->flags |= INODE_FLAG_INLINE;
+    memcpy(inode_inline_data(node), data, INLINE_DATA_SIZE);
+    node->file_size = size;
+    write_inode_to_vfs(vfs, id);
+    return true;
+}
+
+/*
+ * Rewrites compressed file inode id uncompressed, keeping the inode
+ */
+static bool file_expand(VFS **vfs, int32_t id) {
+    inode *node = &(*vfs)->inodes[id];
+    image_source src;
+
+    flush_vfs(vfs);
+    if (!image_source_init(vfs, &src, id)) {
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+    int32_t plain = file_create(vfs, node->file_size, 0, image_read, &src);
+    image_source_free(&src);
+    if (plain == ID_ITEM_FREE) return false;
+
+    /* The new inode takes the compressed block map over and is released with it */
+    inode *copy = &(*vfs)->inodes[plain];
+    uint8_t map[INLINE_DATA_SIZE];
+    uint8_t flags = node->flags;
+    memcpy(map, inode_inline_data(node), INLINE_DATA_SIZE);
+    memcpy(inode_inline_data(node), inode_inline_data(copy), INLINE_DATA_SIZE);
+    memcpy(inode_inline_data(copy), map, INLINE_DATA_SIZE);
+    node->flags = copy->flags;
+    copy->flags = flags;
+
+    write_inode_to_vfs(vfs, id);
+    file_release(vfs, plain);
+    return true;
+}
+
+/*
+ * Truncates or extends file inode id to size bytes. Extending only changes the
+ * size, the new part is a hole. Shrinking releases the blocks past the new end
+ * and the indirect clusters left empty; the tail of the new last block is
+ * cleared, so a later extension reads zeros there. A file that fits in
+ * INLINE_DATA_SIZE bytes moves into its inode, an inline one growing past that
+ * gets a cluster. A compressed file is stored uncompressed first. Prints the
+ * reason on failure.
+ */
+bool file_resize(VFS **vfs, int32_t id, int64_t size) {
+    int64_t count64 = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (size < 0 || size > INT32_MAX || count64 > MAX_FILE_BLOCKS) {
+        printf(FILE_TOO_LARGE_MSG);
+        return false;
+    }
+
+    inode *node = &(*vfs)->inodes[id];
+    if ((node->flags & INODE_FLAG_COMPRESSED) && !file_expand(vfs, id)) return false;
+    if ((node->flags & INODE_FLAG_INLINE) && size <= INLINE_DATA_SIZE) {
+        memset(inode_inline_data(node) + size, 0, INLINE_DATA_SIZE - (size_t)size);
+        if (size == 0) {
+            node->flags &= ~INODE_FLAG_INLINE;
+            blockmap_build(node, NULL, 0, NULL, NULL);
+        }
+        node->file_size = (int32_t)size;
+        write_inode_to_vfs(vfs, id);
+        return true;
+    }
+    if (node->flags & INODE_FLAG_INLINE) {
+        if (!inline_promote(vfs, id)) return false;
+    } else if (size > 0 && size <= INLINE_DATA_SIZE && vfs_inline_enabled(vfs)) {
+        return inline_demote(vfs, id, (int32_t)size);
+    }
+    int32_t count = (int32_t)count64;
+    int32_t tail = (int32_t)(size % CLUSTER_SIZE);
+
+    block_map *map = blockmap_get(vfs, id);
+    if (!map) {
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+    /* Done first, a failed copy of a shared block leaves the file as it was */
+    if (size < (*vfs)->inodes[id].file_size && tail != 0 && count <= map->count &&
+        !clear_block_tail(vfs, id, count - 1, map->blocks[count - 1], tail)) {
+        return false;
+    }
+    if (!blockmap_truncate(vfs, id, count)) {
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
+
+    (*vfs)->inodes[id].file_size = (int32_t)size;
+    write_inode_to_vfs(vfs, id);
+    return true;
+}
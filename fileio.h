@@ -0,0 +1,19 @@
+#ifndef FS_ON_INODE_FILEIO_H
+#define FS_ON_INODE_FILEIO_H
+
+#include <stdio.h>
+#include "structures.h"
+
+bool file_write_clusters(VFS **vfs, const int32_t *blocks, int32_t count, const uint8_t *data);
+int32_t file_import(VFS **vfs, int fd, int64_t size, int options);
+int32_t file_copy(VFS **vfs, int32_t source);
+bool file_reserve(VFS **vfs, int64_t size, int options, file_reservation *res);
+bool file_fill(VFS **vfs, file_reservation *res, int fd);
+int32_t file_finish(VFS **vfs, file_reservation *res, bool filled);
+bool file_link(VFS **vfs, directory *dir, char *name, int32_t id);
+void file_release(VFS **vfs, int32_t id);
+bool file_export(VFS **vfs, int32_t id, int fd);
+bool file_print(VFS **vfs, int32_t id, FILE *out);
+bool file_resize(VFS **vfs, int32_t id, int64_t size);
+
+#endif //FS_ON_INODE_FILEIO_H
@@ -3,8 +3,18 @@
 #include <stdbool.h>
 #include "helpers.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
 
 #include "vfs.h"
+#include "cache.h"
+#include "dirindex.h"
+#include "dcache.h"
+#include "slab.h"
+#include "blockmap.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -30,6 +40,32 @@ bool str_empty(char *str) {
     return false;
 }
 
+/*
+ * Parses a size like "4096", "600K", "600M" or "2G" (a B after the unit is allowed,
+ * units are powers of 1024). Returns false for anything else.
+ */
+bool parse_size(const char *text, int64_t *size) {
+    char *end = NULL;
+    if (!text || *text < '0' || *text > '9') return false;
+
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (errno != 0) return false;
+
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (shift > 0 && (*end == 'B' || *end == 'b')) end++;
+    if (*end != '\0' || value > (INT64_MAX >> shift)) return false;
+
+    *size = (int64_t)value << shift;
+    return true;
+}
+
 
 char * get_line() {
     char * line = calloc(1, 100), * linep = line;
@@ -91,8 +127,8 @@ superblock *superblock_init(int32_t vfs_size) {
     sb->cluster_size = CLUSTER_SIZE;
     sb->cluster_count = vfs_size / CLUSTER_SIZE;
 
-    // bitmap needs one byte per data cluster; compute how many clusters needed to store bitmap
-    int32_t bitmap_bytes = sb->cluster_count * (int)sizeof(int8_t);
+    // bitmap needs one bit per cluster, stored in whole 64-bit words; compute how many clusters needed to store bitmap
+    int32_t bitmap_bytes = (sb->cluster_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * (int)sizeof(uint64_t);
     int32_t bitmap_cluster_count = (bitmap_bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
     if (bitmap_cluster_count < 1) bitmap_cluster_count = 1;
 
@@ -100,19 +136,34 @@ superblock *superblock_init(int32_t vfs_size) {
     int32_t inode_cluster_count = (int32_t)(sb->cluster_count * 0.10);
     if (inode_cluster_count < 1) inode_cluster_count = 1;
 
+    // compute inode_count (how many on-disk inode records we can store)
+    int32_t inode_count = inode_cluster_count * INODES_PER_CLUSTER;
+
+    // inode bitmap uses the same word layout as the data bitmap
+    int32_t inode_bitmap_bytes = (inode_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * (int)sizeof(uint64_t);
+    int32_t inode_bitmap_cluster_count = (inode_bitmap_bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+    // reference count of every cluster that may be shared between files, 2 bytes each
+    int32_t refcount_cluster_count = (int32_t)(((int64_t)sb->cluster_count * (int)sizeof(uint16_t) + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+
+    // deduplication index, a power of two of buckets with at least one per cluster
+    int64_t dedup_entries = 1;
+    while (dedup_entries < sb->cluster_count) dedup_entries <<= 1;
+    int32_t dedup_cluster_count = (int32_t)((dedup_entries * (int)sizeof(dedup_entry) + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+
     // now data clusters are the rest
-    int32_t data_cluster_count = sb->cluster_count - bitmap_cluster_count - inode_cluster_count;
+    int32_t data_cluster_count = sb->cluster_count - bitmap_cluster_count - inode_bitmap_cluster_count -
+                                 refcount_cluster_count - dedup_cluster_count - inode_cluster_count;
     if (data_cluster_count < 1) {
         printf("Not enough space for data clusters (choose larger size).\n");
         exit(1);
     }
 
-    // compute inode_count (how many inodes we can store)
-    int32_t inodes_per_cluster = CLUSTER_SIZE / (int)sizeof(inode);
-    int32_t inode_count = inode_cluster_count * inodes_per_cluster;
-
     int32_t bitmap_start_address = CLUSTER_SIZE;
-    int32_t inode_start_address = bitmap_start_address + bitmap_cluster_count * CLUSTER_SIZE;
+    int32_t inode_bitmap_start_address = bitmap_start_address + bitmap_cluster_count * CLUSTER_SIZE;
+    int32_t refcount_start_address = inode_bitmap_start_address + inode_bitmap_cluster_count * CLUSTER_SIZE;
+    int32_t dedup_start_address = refcount_start_address + refcount_cluster_count * CLUSTER_SIZE;
+    int32_t inode_start_address = dedup_start_address + dedup_cluster_count * CLUSTER_SIZE;
     int32_t data_start_address = inode_start_address + inode_cluster_count * CLUSTER_SIZE;
 
 
@@ -123,24 +174,41 @@ superblock *superblock_init(int32_t vfs_size) {
     sb->bitmap_start_address = bitmap_start_address;
     sb->inode_start_address = inode_start_address;
     sb->data_start_address = data_start_address;
+    sb->features = FEATURE_PACKED_BITMAP | FEATURE_INODE_BITMAP | FEATURE_REFCOUNTS | FEATURE_INLINE_DATA |
+                   FEATURE_DEDUP_INDEX;
+    sb->free_hint = 1;
+    sb->inode_bitmap_cluster_count = inode_bitmap_cluster_count;
+    sb->inode_bitmap_start_address = inode_bitmap_start_address;
+    sb->free_inode_count = inode_count;
+    sb->inode_hint = 1;
+    sb->refcount_cluster_count = refcount_cluster_count;
+    sb->refcount_start_address = refcount_start_address;
+    sb->dedup_cluster_count = dedup_cluster_count;
+    sb->dedup_start_address = dedup_start_address;
 
     return sb;
 }
 
 
-dir_item *create_directory_item(int32_t inode_id, const char *name) {
+dir_item *create_directory_item(VFS **vfs, int32_t inode_id, const char *name) {
     // create dir_item for root (inode 0, name "/")
-    dir_item *dir_item = calloc(1, sizeof(dir_item));
-    if (!dir_item) {return NULL; }
+    dir_item *item = slab_alloc(&(*vfs)->item_pool);
+    if (!item) {return NULL; }
 
 
-    dir_item->inode = inode_id;
-    memset(dir_item->item_name, 0, MAX_ITEM_NAME_LENGTH);
+    item->inode = inode_id;
+    memset(item->item_name, 0, MAX_ITEM_NAME_LENGTH);
     // set name to "/" (or empty string depending on convention)
-    strncpy(dir_item->item_name, name, MAX_ITEM_NAME_LENGTH - 1);
-    dir_item->next = NULL;
+    strncpy(item->item_name, name, MAX_ITEM_NAME_LENGTH - 1);
+    item->next = NULL;
+    item->cluster = ID_ITEM_FREE;   /* Set when the entry is stored in the parent */
+    item->slot = 0;
 
-    return dir_item;
+    return item;
+}
+
+void free_directory_item(VFS **vfs, dir_item *item) {
+    slab_free(&(*vfs)->item_pool, item);
 }
 
 /*
@@ -152,10 +220,12 @@ void check_sb_info(VFS **vfs) {
            "Cluster size: %d\n"
            "Cluster count: %d\n"
            "Max Inode Count: %d\n"
+           "Free Inode Count: %d\n"
            "Bitmap cluster count: %d\n"
            "Inode cluster count: %d\n"
            "Data cluster count: %d\n"
            "Bitmap start address: %d\n"
+           "Inode bitmap start address: %d\n"
            "Inode start address: %d\n"
            "Data start address: %d\n",
            (*vfs)->superblock->signature,
@@ -163,10 +233,12 @@ void check_sb_info(VFS **vfs) {
            (*vfs)->superblock->cluster_size,
            (*vfs)->superblock->cluster_count,
            (*vfs)->superblock->inode_count,
+           (*vfs)->superblock->free_inode_count,
            (*vfs)->superblock->bitmap_cluster_count,
            (*vfs)->superblock->inode_cluster_count,
            (*vfs)->superblock->data_cluster_count,
            (*vfs)->superblock->bitmap_start_address,
+           (*vfs)->superblock->inode_bitmap_start_address,
            (*vfs)->superblock->inode_start_address,
            (*vfs)->superblock->data_start_address);
 
@@ -181,7 +253,7 @@ void check_sb_info(VFS **vfs) {
 
     printf("\nData bitmapa:\n");
     for (int i = 0 ; i < (*vfs)->superblock->data_cluster_count; i++){
-        printf("%d", (*vfs)->data_bitmap[i]);
+        printf("%d", bitmap_get(vfs, i));
     }
     printf("\n");
 }
@@ -222,11 +294,96 @@ int parse_path(VFS **vfs, char *path, char **name, directory **dir) {
     return NO_ERROR_CODE;
 }
 
+/*
+ * Writes the absolute path of dir into out. Returns false when it does not fit.
+ */
+bool directory_path(directory *dir, char *out, size_t size) {
+    size_t length = 0;
+
+    if (size < 2) return false;
+    out[size - 1] = '\0';
+
+    /* Built from the end, then moved to the start of out */
+    for (directory *cur = dir; cur->parent != cur; cur = cur->parent) {
+        size_t name_length = strnlen(cur->current->item_name, MAX_ITEM_NAME_LENGTH);
+        if (length + name_length + 1 > size - 1) return false;
+        length += name_length + 1;
+        memcpy(out + size - 1 - length + 1, cur->current->item_name, name_length);
+        out[size - 1 - length] = '/';
+    }
+
+    if (length == 0) {
+        strcpy(out, "/");
+        return true;
+    }
+    memmove(out, out + size - 1 - length, length + 1);
+    return true;
+}
+
+/*
+ * Turns path into an absolute path without empty, "." and ".." components, relative
+ * paths starting from the current directory. Returns false when it does not fit.
+ */
+bool normalize_path(VFS **vfs, const char *path, char *out, size_t size) {
+    size_t length = 0;
+
+    if (path[0] != '/') {
+        if (!directory_path((*vfs)->current_dir, out, size)) return false;
+        length = strlen(out);
+        if (length == 1) length = 0;    /* Root */
+    }
+
+    while (*path) {
+        while (*path == '/') path++;
+        const char *end = path;
+        while (*end && *end != '/') end++;
+        size_t component = (size_t)(end - path);
+
+        if (component == 0 || (component == 1 && path[0] == '.')) {
+            /* Nothing to add */
+        } else if (component == 2 && path[0] == '.' && path[1] == '.') {
+            while (length > 0 && out[length - 1] != '/') length--;
+            if (length > 0) length--;
+        } else {
+            if (length + 1 + component >= size) return false;
+            out[length++] = '/';
+            memcpy(out + length, path, component);
+            length += component;
+        }
+        path = end;
+    }
+
+    if (length == 0) out[length++] = '/';
+    out[length] = '\0';
+    return true;
+}
+
+/*
+ * Resolves path to a directory, through the path cache when the path is in it
+ */
 directory *find_directory(VFS **vfs, char *path) {
     if (str_empty(path)) {
         return NULL;
     }
 
+    char normalized[DCACHE_PATH_LENGTH];
+    bool cacheable = normalize_path(vfs, path, normalized, sizeof(normalized));
+    directory *dir;
+
+    if (cacheable && dcache_lookup((*vfs)->dcache, normalized, &dir)) {
+        if (dir) vfs_open_directory(vfs, dir->parent, dir->current);  /* Keeps it recently used */
+        return dir;
+    }
+
+    dir = walk_directory_path(vfs, path);
+    if (cacheable) dcache_insert((*vfs)->dcache, normalized, dir);
+    return dir;
+}
+
+/*
+ * Resolves path one component at a time, loading the directories on the way
+ */
+directory *walk_directory_path(VFS **vfs, char *path) {
     directory *current;
 
     if (path[0] == '/') {
@@ -249,11 +406,11 @@ directory *find_directory(VFS **vfs, char *path) {
         } else if (streq(token, "..")) {
             current = current->parent;
         } else {
-            dir_item *found = find_item_by_name(current->subdir, token);
+            dir_item *found = directory_find_item(current, token);
             if (found == NULL) {
                 return NULL;
             }
-            current = (*vfs)->all_dirs[found->inode];
+            current = vfs_open_directory(vfs, current, found);   /* NULL for files */
             if (current == NULL) {
                 return NULL;
             }
@@ -281,30 +438,267 @@ dir_item *find_item_by_name(dir_item *first, const char *name) {
 }
 
 bool check_if_exists(directory *dir, char *name) {
-    dir_item *item;
+    return directory_find_item(dir, name) != NULL;
+}
 
-    /* Loop through files of the directory */
-    item = dir->file;
-    while (item != NULL) {
-        if (streq(name, item->item_name)) {
-            return true;
+/*
+ * Looks up a file or subdir of the directory by name through its index
+ */
+dir_item *directory_find_item(directory *dir, const char *name) {
+    if (dir == NULL || name == NULL) {
+        return NULL;
+    }
+    return dir_index_find(&dir->index, name);
+}
+
+/*
+ * Appends item to the subdir or file list and adds it to the name index
+ */
+bool directory_add_item(directory *dir, dir_item *item, bool is_dir) {
+    if (!dir_index_insert(&dir->index, item)) {
+        return false;
+    }
+
+    dir_item **head = is_dir ? &dir->subdir : &dir->file;
+    dir_item **tail = is_dir ? &dir->subdir_tail : &dir->file_tail;
+
+    item->next = NULL;
+    if (*head == NULL) {
+        *head = item;
+    } else {
+        (*tail)->next = item;
+    }
+    *tail = item;
+    return true;
+}
+
+/*
+ * Unlinks the item called name from the subdir or file list and the index, returns it
+ */
+dir_item *directory_remove_item(directory *dir, const char *name, bool is_dir) {
+    dir_item **head = is_dir ? &dir->subdir : &dir->file;
+    dir_item **tail = is_dir ? &dir->subdir_tail : &dir->file_tail;
+    dir_item *item = directory_find_item(dir, name);
+    if (item == NULL) {
+        return NULL;
+    }
+
+    dir_item *prev = NULL;
+    dir_item *current = *head;
+    while (current != NULL && current != item) {
+        prev = current;
+        current = current->next;
+    }
+    if (current == NULL) {  /* In the other list */
+        return NULL;
+    }
+
+    if (prev == NULL) {
+        *head = item->next;
+    } else {
+        prev->next = item->next;
+    }
+    if (*tail == item) {
+        *tail = prev;
+    }
+    item->next = NULL;
+
+    dir_index_remove(&dir->index, name);
+    return item;
+}
+
+/*
+ * Returns the first free block in [from, limit) or ID_ITEM_FREE. Works on whole
+ * 64-bit words; with SSE2 runs of full words are skipped two at a time.
+ */
+int32_t bitmap_next_free(const uint64_t *bitmap, int32_t from, int32_t limit) {
+    if (from >= limit) return ID_ITEM_FREE;
+
+    int32_t word = from / BITMAP_WORD_BITS;
+    int32_t last_word = (limit - 1) / BITMAP_WORD_BITS;
+    uint64_t free_bits = ~bitmap[word] & (~0ULL << (from % BITMAP_WORD_BITS));
+
+    while (!free_bits) {
+        word++;
+#ifdef __SSE2__
+        const __m128i full = _mm_set1_epi8(-1);
+        while (word < last_word) {
+            __m128i pair = _mm_loadu_si128((const __m128i *)(bitmap + word));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(pair, full)) != 0xFFFF) break;
+            word += 2;
         }
-        item = item->next;
+#endif
+        if (word > last_word) return ID_ITEM_FREE;
+        free_bits = ~bitmap[word];
     }
 
-    /* Loop through subdirs of the directory */
-    item = dir->subdir;
-    while (item != NULL) {
-        if (streq(name, item->item_name)) {
-            return true;
+    int32_t block = word * BITMAP_WORD_BITS + __builtin_ctzll(free_bits);
+    return block < limit ? block : ID_ITEM_FREE;
+}
+
+/*
+ * Returns the first used block in [from, limit), or limit when the rest is free
+ */
+static int32_t bitmap_next_used(const uint64_t *bitmap, int32_t from, int32_t limit) {
+    if (from >= limit) return limit;
+
+    int32_t word = from / BITMAP_WORD_BITS;
+    int32_t last_word = (limit - 1) / BITMAP_WORD_BITS;
+    uint64_t used_bits = bitmap[word] & (~0ULL << (from % BITMAP_WORD_BITS));
+
+    while (!used_bits) {
+        word++;
+#ifdef __SSE2__
+        const __m128i empty = _mm_setzero_si128();
+        while (word < last_word) {
+            __m128i pair = _mm_loadu_si128((const __m128i *)(bitmap + word));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(pair, empty)) != 0xFFFF) break;
+            word += 2;
+        }
+#endif
+        if (word > last_word) return limit;
+        used_bits = bitmap[word];
+    }
+
+    int32_t block = word * BITMAP_WORD_BITS + __builtin_ctzll(used_bits);
+    return block < limit ? block : limit;
+}
+
+static int compare_extent_length_desc(const void *a, const void *b) {
+    int32_t x = ((const extent *)a)->length, y = ((const extent *)b)->length;
+    return (y > x) - (y < x);
+}
+
+static int compare_extent_start(const void *a, const void *b) {
+    int32_t x = ((const extent *)a)->start, y = ((const extent *)b)->start;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Takes the first free run of at least count clusters from the superblock hint
+ * (wrapping around), looking at no more than EXTENT_FIT_CANDIDATES runs
+ */
+static bool find_fit_from_hint(VFS **vfs, int32_t count, extent *fit) {
+    int32_t limit = (*vfs)->superblock->data_cluster_count;
+    int32_t hint = (*vfs)->superblock->free_hint;
+    if (hint < 1 || hint >= limit) hint = 1;    /* Skip root */
+
+    int candidates = 0;
+    int32_t ranges[2][2] = {{hint, limit}, {1, hint}};
+    for (int r = 0; r < 2; r++) {
+        int32_t block = ranges[r][0];
+        while (candidates < EXTENT_FIT_CANDIDATES &&
+               (block = bitmap_next_free((*vfs)->data_bitmap, block, ranges[r][1])) != ID_ITEM_FREE) {
+            int32_t end = bitmap_next_used((*vfs)->data_bitmap, block, ranges[r][1]);
+            if (end - block >= count) {
+                fit->start = block;
+                fit->length = count;
+                return true;
+            }
+            candidates++;
+            block = end;
         }
-        item = item->next;
     }
     return false;
 }
 
+/*
+ * Finds free space for count clusters as a list of extents sorted by start. The
+ * first run from the hint that holds all of them is taken; when the runs tried
+ * there are too short, the whole bitmap is scanned and the smallest run that
+ * fits is used (best fit, keeps big runs for big files), or else the largest runs
+ * so the result has as few extents as possible. Nothing is marked used. Returns
+ * NULL if there is not enough space.
+ */
+extent *find_free_extents(VFS **vfs, int32_t count, int *extent_count) {
+    int32_t limit = (*vfs)->superblock->data_cluster_count;
+    extent best = {ID_ITEM_FREE, 0};
+    extent *runs = NULL;
+    int run_count = 0, run_capacity = 0;
+    int64_t total_free = 0;
+
+    *extent_count = 0;
+    if (count <= 0) return NULL;
+
+    if (find_fit_from_hint(vfs, count, &best)) {
+        extent *single = malloc(sizeof(extent));
+        if (!single) {
+            printf(MEMORY_ERROR_MSG);
+            return NULL;
+        }
+        *single = best;
+        *extent_count = 1;
+        return single;
+    }
+
+    int32_t block = 1;  /* Skip root */
+    while ((block = bitmap_next_free((*vfs)->data_bitmap, block, limit)) != ID_ITEM_FREE) {
+        int32_t end = bitmap_next_used((*vfs)->data_bitmap, block, limit);
+        int32_t length = end - block;
+
+        if (length >= count) {
+            if (best.length == 0 || length < best.length) {
+                best.start = block;
+                best.length = length;
+            }
+            if (length == count) break;     /* Exact fit, cannot do better */
+        } else if (best.length == 0) {
+            if (run_count == run_capacity) {
+                run_capacity = run_capacity ? run_capacity * 2 : 64;
+                extent *grown = realloc(runs, run_capacity * sizeof(extent));
+                if (!grown) {
+                    free(runs);
+                    printf(MEMORY_ERROR_MSG);
+                    return NULL;
+                }
+                runs = grown;
+            }
+            runs[run_count].start = block;
+            runs[run_count].length = length;
+            run_count++;
+        }
+
+        total_free += length;
+        block = end;
+    }
+
+    if (best.length > 0) {
+        free(runs);
+        extent *single = malloc(sizeof(extent));
+        if (!single) {
+            printf(MEMORY_ERROR_MSG);
+            return NULL;
+        }
+        single->start = best.start;
+        single->length = count;
+        *extent_count = 1;
+        return single;
+    }
+
+    if (total_free < count) {
+        free(runs);
+        return NULL;
+    }
+
+    /* Largest runs first, the last one taken is trimmed to what is still missing */
+    qsort(runs, run_count, sizeof(extent), compare_extent_length_desc);
+    int taken = 0;
+    for (int32_t missing = count; missing > 0; taken++) {
+        if (runs[taken].length > missing) runs[taken].length = missing;
+        missing -= runs[taken].length;
+    }
+    qsort(runs, taken, sizeof(extent), compare_extent_start);
+
+    *extent_count = taken;
+    return runs;
+}
+
+/*
+ * Finds count free data blocks, none of them marked. A single block comes from the
+ * superblock hint (wrapping around); more blocks are taken as contiguous as possible
+ * through find_free_extents(). The hint moves past the blocks found.
+ */
 int32_t *find_free_data_blocks(VFS** vfs, int count) {
-    int i, found_blocks = 0;
     int32_t *blocks = calloc(count, sizeof(int32_t));
 
     if (blocks == NULL) {
@@ -312,39 +706,197 @@ int32_t *find_free_data_blocks(VFS** vfs, int count) {
         return NULL;
     }
 
-    /* Find all data blocks */
-    for (i = 1; i < (*vfs)->superblock->data_cluster_count; i++) { /* Skip root */
-        if ((*vfs)->data_bitmap[i] == 0) {
-            blocks[found_blocks] = i;
-            found_blocks++;
-            if (found_blocks == count) {
-                return blocks;
+    int32_t limit = (*vfs)->superblock->data_cluster_count;
+
+    if (count > 1) {
+        int extent_count, found_blocks = 0;
+        extent *extents = find_free_extents(vfs, count, &extent_count);
+        if (!extents) {
+            free(blocks);
+            return NULL;
+        }
+        for (int i = 0; i < extent_count; i++) {
+            for (int32_t j = 0; j < extents[i].length; j++) {
+                blocks[found_blocks++] = extents[i].start + j;
             }
         }
+        int32_t next = extents[extent_count - 1].start + extents[extent_count - 1].length;
+        (*vfs)->superblock->free_hint = next < limit ? next : 1;
+        (*vfs)->superblock_dirty = true;
+        free(extents);
+        return blocks;
     }
 
-    free(blocks);
-    return NULL;
+    int32_t hint = (*vfs)->superblock->free_hint;
+    if (hint < 1 || hint >= limit) hint = 1;    /* Skip root */
+
+    /* From the hint to the end, then from the start up to the hint */
+    int32_t block = bitmap_next_free((*vfs)->data_bitmap, hint, limit);
+    if (block == ID_ITEM_FREE) block = bitmap_next_free((*vfs)->data_bitmap, 1, hint);
+    if (block == ID_ITEM_FREE) {
+        free(blocks);
+        return NULL;
+    }
+
+    blocks[0] = block;
+    (*vfs)->superblock->free_hint = block + 1 < limit ? block + 1 : 1;
+    (*vfs)->superblock_dirty = true;
+    return blocks;
 }
 
-void print_directory_content(directory *dir) {
-    printf("Directories:\n");
-    dir_item *sub = dir->subdir;
-    if (!sub) printf("  <none>\n");
+static const inode *sort_inodes;     /* For compare_items_size(), qsort has no context argument */
+
+static int compare_items_name(const void *a, const void *b) {
+    return strncmp((*(dir_item * const *)a)->item_name, (*(dir_item * const *)b)->item_name, MAX_ITEM_NAME_LENGTH);
+}
 
-    while (sub) {
-        printf("DIR: %s\n", sub->item_name);
-        sub = sub->next;
+/*
+ * Largest first, equal sizes by name
+ */
+static int compare_items_size(const void *a, const void *b) {
+    int32_t x = sort_inodes[(*(dir_item * const *)a)->inode].file_size;
+    int32_t y = sort_inodes[(*(dir_item * const *)b)->inode].file_size;
+    if (x != y) return (y > x) - (y < x);
+    return compare_items_name(a, b);
+}
+
+/*
+ * Starts a walk over the items of dir in the given LS_ORDER_*
+ */
+bool dir_iter_init(VFS **vfs, dir_iter *it, directory *dir, int order) {
+    memset(it, 0, sizeof(dir_iter));
+    it->file_head = dir->file;
+    it->next = dir->subdir;
+    if (!it->next) {
+        it->next = dir->file;
+        it->in_files = true;
+    }
+    if (order == LS_ORDER_NONE || dir->index.count == 0) return true;
+
+    it->sorted = malloc(dir->index.count * sizeof(dir_item *));
+    if (!it->sorted) return false;
+
+    for (dir_item *item = dir->subdir; item && it->count < dir->index.count; item = item->next) {
+        it->sorted[it->count++] = item;
+    }
+    it->subdir_count = it->count;
+    for (dir_item *item = dir->file; item && it->count < dir->index.count; item = item->next) {
+        it->sorted[it->count++] = item;
+    }
+
+    int (*compare)(const void *, const void *) = order == LS_ORDER_SIZE ? compare_items_size : compare_items_name;
+    sort_inodes = (*vfs)->inodes;
+    qsort(it->sorted, it->subdir_count, sizeof(dir_item *), compare);
+    qsort(it->sorted + it->subdir_count, it->count - it->subdir_count, sizeof(dir_item *), compare);
+    return true;
+}
+
+/*
+ * Returns the next item or NULL at the end; *is_dir tells from which list it is
+ */
+dir_item *dir_iter_next(dir_iter *it, bool *is_dir) {
+    if (it->sorted) {
+        if (it->pos >= it->count) return NULL;
+        *is_dir = it->pos < it->subdir_count;
+        return it->sorted[it->pos++];
+    }
+
+    dir_item *item = it->next;
+    if (!item) return NULL;
+    *is_dir = !it->in_files;
+
+    it->next = item->next;
+    if (!it->next && !it->in_files) {
+        it->next = it->file_head;
+        it->in_files = true;
+    }
+    return item;
+}
+
+void dir_iter_close(dir_iter *it) {
+    free(it->sorted);
+    it->sorted = NULL;
+}
+
+/*
+ * Output of ls, collected in LS_BUFFER_SIZE blocks so a large directory is written
+ * with a few writes instead of one per line
+ */
+typedef struct LS_OUTPUT {
+    char *data;
+    size_t used;
+} ls_output;
+
+static void ls_flush(ls_output *out) {
+    fwrite(out->data, 1, out->used, stdout);
+    out->used = 0;
+}
+
+static void ls_printf(ls_output *out, const char *format, ...) {
+    if (out->used + 128 > LS_BUFFER_SIZE) ls_flush(out);   /* Longer than any line */
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out->data + out->used, LS_BUFFER_SIZE - out->used, format, args);
+    va_end(args);
+    if (n > 0) out->used += (size_t)n;
+}
+
+/*
+ * Lists the items of dir. Without options the subdirs and files are printed in two
+ * sections like before; the long format prints one table with the type, inode and
+ * size taken from the inode table. A page selects page_size items of the walk.
+ */
+void print_directory_content(VFS **vfs, directory *dir, const ls_options *options) {
+    static char buffer[LS_BUFFER_SIZE];
+    ls_output out = {buffer, 0};
+    dir_iter it;
+
+    if (!dir_iter_init(vfs, &it, dir, options->order)) {
+        printf(MEMORY_ERROR_MSG);
+        return;
     }
 
-    printf("\nFiles:\n");
-    dir_item *file = dir->file;
-    if (!file) printf("  <none>\n");
+    /* 64-bit, a far page of a large page size is past any directory */
+    int64_t first = options->page_size > 0 ? (int64_t)(options->page - 1) * options->page_size : 0;
+    int64_t position = 0;
+    int32_t printed = 0;
+    bool is_dir, section_dirs = false, section_files = false;
+    dir_item *item;
+
+    if (options->long_format) ls_printf(&out, "%-5s %8s %12s  %s\n", "TYPE", "INODE", "SIZE", "NAME");
+
+    while ((item = dir_iter_next(&it, &is_dir)) != NULL) {
+        if (position++ < first) continue;
+        if (options->page_size > 0 && printed == options->page_size) break;
+        printed++;
 
-    while (file) {
-        printf("FILE: %s\n", file->item_name);
-        file = file->next;
+        if (options->long_format) {
+            const inode *node = &(*vfs)->inodes[item->inode];
+            ls_printf(&out, "%-5s %8d %12d  %s\n", is_dir ? "DIR" : "FILE", item->inode, node->file_size,
+                      item->item_name);
+            continue;
+        }
+
+        if (is_dir && !section_dirs) {
+            ls_printf(&out, "Directories:\n");
+            section_dirs = true;
+        }
+        if (!is_dir && !section_files) {
+            if (!section_dirs) ls_printf(&out, "Directories:\n  <none>\n");
+            ls_printf(&out, "\nFiles:\n");
+            section_dirs = section_files = true;
+        }
+        ls_printf(&out, is_dir ? "DIR: %s\n" : "FILE: %s\n", item->item_name);
     }
+
+    if (!options->long_format) {
+        if (!section_dirs) ls_printf(&out, "Directories:\n  <none>\n");
+        if (!section_files) ls_printf(&out, "\nFiles:\n  <none>\n");
+    }
+
+    ls_flush(&out);
+    dir_iter_close(&it);
 }
 
 dir_item *find_diritem(dir_item *item,char *name) {
@@ -397,6 +949,15 @@ void print_dir_item_info(VFS **vfs, dir_item *item) {
     printf("References: %d\n", node.references);
     printf(node.isDirectory ? "Type: Directory\n" : "Type: File\n");
 
+    if (node.flags & INODE_FLAG_INLINE) {
+        printf("Inline: %d B in the i-node\n\n", node.file_size);
+        return;
+    }
+    if (node.flags & INODE_FLAG_COMPRESSED) {
+        block_map *map = blockmap_get(vfs, item->inode);
+        if (map) printf("Compressed: %d clusters for %d B\n", map->count, node.file_size);
+    }
+
     printf("Direct: ");
     int printed = 0;
     if (node.direct1 != ID_ITEM_FREE) { printf("%d", node.direct1); printed = 1; }
@@ -410,13 +971,11 @@ void print_dir_item_info(VFS **vfs, dir_item *item) {
     printf("Indirect 1: ");
     if (node.indirect1 != ID_ITEM_FREE) {
         printf("(%d): ", node.indirect1);
-        seek_data_cluster(vfs, node.indirect1);
-        int32_t number;
+        int32_t *refs = (int32_t *) cache_get_cluster(vfs, node.indirect1);
         int first = 1;
-        for (int i = 0; i < INT32_COUNT_IN_BLOCK; i++) {
-            vfs_read_int32(vfs, &number);
-            if (number == EMPTY_ADDRESS) break;
-            printf(first ? "%d" : ", %d", number);
+        for (int i = 0; refs && i < INT32_COUNT_IN_BLOCK; i++) {
+            if (refs[i] == EMPTY_ADDRESS) break;
+            printf(first ? "%d" : ", %d", refs[i]);
             first = 0;
         }
         if (first) printf("EMPTY");
@@ -428,13 +987,11 @@ void print_dir_item_info(VFS **vfs, dir_item *item) {
     printf("Indirect 2: ");
     if (node.indirect2 != ID_ITEM_FREE) {
         printf("(%d): ", node.indirect2);
-        seek_data_cluster(vfs, node.indirect2);
-        int32_t number;
+        int32_t *refs = (int32_t *) cache_get_cluster(vfs, node.indirect2);
         int first = 1;
-        for (int i = 0; i < INT32_COUNT_IN_BLOCK; i++) {
-            vfs_read_int32(vfs, &number);
-            if (number == EMPTY_ADDRESS) break;
-            printf(first ? "%d" : ", %d", number);
+        for (int i = 0; refs && i < INT32_COUNT_IN_BLOCK; i++) {
+            if (refs[i] == EMPTY_ADDRESS) break;
+            printf(first ? "%d" : ", %d", refs[i]);
             first = 0;
         }
         if (first) printf("EMPTY");
@@ -11,17 +11,30 @@
 
 bool streq(char *str1, char *str2);
 bool str_empty(char *str);
+bool parse_size(const char *text, int64_t *size);
 char * get_line();
 void remove_nl_inplace(char *message);
 superblock *superblock_init(int32_t vfs_size);
-dir_item *create_directory_item(int32_t inode_id, const char *name);
+dir_item *create_directory_item(VFS **vfs, int32_t inode_id, const char *name);
+void free_directory_item(VFS **vfs, dir_item *item);
 void check_sb_info(VFS **vfs);
 int parse_path(VFS **vfs, char *path, char **name, directory **dir);
+bool directory_path(directory *dir, char *out, size_t size);
+bool normalize_path(VFS **vfs, const char *path, char *out, size_t size);
 directory *find_directory(VFS **vfs, char *path);
+directory *walk_directory_path(VFS **vfs, char *path);
 dir_item *find_item_by_name(dir_item *first, const char *name);
 bool check_if_exists(directory *dir, char *name);
+dir_item *directory_find_item(directory *dir, const char *name);
+bool directory_add_item(directory *dir, dir_item *item, bool is_dir);
+dir_item *directory_remove_item(directory *dir, const char *name, bool is_dir);
 int32_t *find_free_data_blocks(VFS** vfs, int count);
-void print_directory_content(directory *dir);
+extent *find_free_extents(VFS **vfs, int32_t count, int *extent_count);
+int32_t bitmap_next_free(const uint64_t *bitmap, int32_t from, int32_t limit);
+bool dir_iter_init(VFS **vfs, dir_iter *it, directory *dir, int order);
+dir_item *dir_iter_next(dir_iter *it, bool *is_dir);
+void dir_iter_close(dir_iter *it);
+void print_directory_content(VFS **vfs, directory *dir, const ls_options *options);
 dir_item *find_diritem(dir_item *item,char *name);
 dir_item *remove_diritem(dir_item **head, const char *name);
 void print_dir_item_info(VFS **vfs, dir_item *item);
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "import.h"
+#include "vfs.h"
+#include "helpers.h"
+#include "fileio.h"
+
+
+/*
+ * Recursive import of a host directory tree. The calling thread walks the tree,
+ * mirrors every directory in the volume and queues the regular files; a pool of
+ * worker threads imports them. Everything that changes VFS structures (inode
+ * table, bitmaps, directories, cluster cache) runs under one lock and is kept
+ * short: reserving the clusters of a file and linking it when done. Reading the
+ * host file and writing its clusters with positional writes needs no lock, so
+ * several files are in flight at once.
+ */
+
+typedef struct IMPORT_JOB {
+    char *path;                         // host file
+    char *name;                         // name in the volume
+    directory *dir;                     // volume directory receiving it
+    struct IMPORT_JOB *next;
+} import_job;
+
+typedef struct IMPORT_POOL {
+    VFS **vfs;
+    pthread_mutex_t lock;               // guards the queue, the counters and every VFS structure
+    pthread_cond_t has_job;
+    pthread_cond_t has_room;
+    import_job *head, *tail;
+    int32_t queued;
+    bool closing;                       // the walk is over, workers leave when the queue is empty
+    int32_t files, dirs, failed;
+    int options;                        // STORE_* flags of the imported files
+} import_pool;
+
+static void import_failed(import_pool *pool, const char *path) {
+    printf(IMPORT_FAILED_MSG, path);
+    pool->failed++;
+}
+
+/*
+ * Imports one host file into the volume. Called by the workers (or by the walk
+ * when no worker could be started), without the lock held.
+ */
+static void import_file(import_pool *pool, import_job *job) {
+    VFS **vfs = pool->vfs;
+    struct stat st;
+    file_reservation res;
+
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        pthread_mutex_lock(&pool->lock);
+        import_failed(pool, job->path);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_mutex_lock(&pool->lock);
+    bool exists = check_if_exists(job->dir, job->name);
+    if (exists) printf(FILE_EXISTS_MSG);
+    bool reserved = !exists && file_reserve(vfs, st.st_size, pool->options, &res);
+    pthread_mutex_unlock(&pool->lock);
+
+    bool filled = reserved && file_fill(vfs, &res, fd);
+    close(fd);
+
+    pthread_mutex_lock(&pool->lock);
+    int32_t id = reserved ? file_finish(vfs, &res, filled) : ID_ITEM_FREE;
+    if (id != ID_ITEM_FREE && file_link(vfs, job->dir, job->name, id)) {
+        pool->files++;
+    } else {
+        import_failed(pool, job->path);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *import_worker(void *arg) {
+    import_pool *pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->head && !pool->closing) pthread_cond_wait(&pool->has_job, &pool->lock);
+        import_job *job = pool->head;
+        if (job) {
+            pool->head = job->next;
+            if (!pool->head) pool->tail = NULL;
+            pool->queued--;
+            pthread_cond_signal(&pool->has_room);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!job) break;
+
+        import_file(pool, job);
+        free(job->path);
+        free(job->name);
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+ * Hands a file to the workers, waiting while IMPORT_QUEUE_LIMIT files are queued
+ */
+static void import_enqueue(import_pool *pool, const char *path, const char *name, directory *dir) {
+    import_job *job = malloc(sizeof(import_job));
+    if (job) {
+        job->path = strdup(path);
+        job->name = strdup(name);
+        job->dir = dir;
+        job->next = NULL;
+    }
+    if (!job || !job->path || !job->name) {
+        if (job) {
+            free(job->path);
+            free(job->name);
+        }
+        free(job);
+        pthread_mutex_lock(&pool->lock);
+        import_failed(pool, path);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued >= IMPORT_QUEUE_LIMIT) pthread_cond_wait(&pool->has_room, &pool->lock);
+    if (pool->tail) pool->tail->next = job;
+    else pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->has_job);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Mirrors the host directory at path (a PATH_MAX buffer holding length characters)
+ * into dir: subdirectories are created or reused and walked, regular files are
+ * queued, anything else is skipped
+ */
+static void import_directory(import_pool *pool, char *path, size_t length, directory *dir, bool inline_files) {
+    DIR *host = opendir(path);
+    if (!host) {
+        pthread_mutex_lock(&pool->lock);
+        import_failed(pool, path);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(host)) != NULL) {
+        if (streq(entry->d_name, ".") || streq(entry->d_name, "..")) continue;
+
+        size_t name_length = strlen(entry->d_name);
+        if (length + 1 + name_length >= PATH_MAX) continue;
+        path[length] = '/';
+        memcpy(path + length + 1, entry->d_name, name_length + 1);
+
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            import_failed(pool, path);
+            pthread_mutex_unlock(&pool->lock);
+        } else if (S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&pool->lock);
+            dir_item *item = directory_find_item(dir, entry->d_name);
+            directory *child = item ? vfs_open_directory(pool->vfs, dir, item)
+                                    : vfs_make_directory(pool->vfs, dir, entry->d_name);
+            if (child && !item) pool->dirs++;
+            if (!child) import_failed(pool, path);
+            pthread_mutex_unlock(&pool->lock);
+
+            if (child) import_directory(pool, path, length + 1 + name_length, child, inline_files);
+        } else if (S_ISREG(st.st_mode)) {
+            if (inline_files) {
+                import_job job = {path, entry->d_name, dir, NULL};
+                import_file(pool, &job);
+            } else {
+                import_enqueue(pool, path, entry->d_name, dir);
+            }
+        }
+        path[length] = '\0';
+    }
+    closedir(host);
+}
+
+/*
+ * Imports the host directory tree at path into dir with a pool of worker
+ * threads, one per online CPU up to IMPORT_THREADS_MAX. Files are stored as
+ * options (STORE_*) ask. Prints a summary and returns false when some entry
+ * could not be imported.
+ */
+bool import_tree(VFS **vfs, char *path, directory *dir, int options) {
+    char buffer[PATH_MAX];
+    size_t length = strlen(path);
+    if (length >= sizeof(buffer)) return false;
+    memcpy(buffer, path, length + 1);
+
+    import_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.vfs = vfs;
+    pool.options = options;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.has_job, NULL);
+    pthread_cond_init(&pool.has_room, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus < 1 ? 1 : cpus > IMPORT_THREADS_MAX ? IMPORT_THREADS_MAX : (int)cpus;
+    pthread_t threads[IMPORT_THREADS_MAX];
+    int started = 0;
+
+    /* Workers write through the image descriptor only, the stream is brought in line before and after */
+    vfs_sync_stream(vfs);
+    while (started < thread_count && pthread_create(&threads[started], NULL, import_worker, &pool) == 0) {
+        started++;
+    }
+
+    import_directory(&pool, buffer, length, dir, started == 0);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.closing = true;
+    pthread_cond_broadcast(&pool.has_job);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    vfs_sync_stream(vfs);
+
+    pthread_cond_destroy(&pool.has_room);
+    pthread_cond_destroy(&pool.has_job);
+    pthread_mutex_destroy(&pool.lock);
+
+    printf(IMPORT_SUMMARY_MSG, pool.files, pool.dirs, pool.failed);
+    return pool.failed == 0;
+}
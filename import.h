@@ -0,0 +1,8 @@
+#ifndef FS_ON_INODE_IMPORT_H
+#define FS_ON_INODE_IMPORT_H
+
+#include "structures.h"
+
+bool import_tree(VFS **vfs, char *path, directory *dir, int options);
+
+#endif //FS_ON_INODE_IMPORT_H
@@ -8,6 +8,7 @@
 #include "commands.h"
 #include "vfs.h"
 #include <string.h>
+#include <unistd.h>
 #include "helpers.h"
 #include "constants.h"
 
@@ -58,15 +59,31 @@ void show_banner() {
 int main(int argc, char *argv[]) {
     show_banner();
 
-    if (argc == 2) {
-        char *filename = argv[1];
+    vfs_options options = {BLOCK_CACHE_CLUSTERS, false};
+    int opt;
+    while ((opt = getopt(argc, argv, "c:m")) != -1) {
+        switch (opt) {
+            case 'c':
+                options.cache_clusters = atoi(optarg);
+                break;
+            case 'm':
+                options.use_mmap = true;
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+
+    if (argc > 0 && optind == argc - 1) {
+        char *filename = argv[optind];
         printf("Loading virtual filesystem: %s\n", filename);
 
-        initialize_vfs(&current_vfs, filename);
+        initialize_vfs(&current_vfs, filename, &options);
         run_shell();
     } else {
-        printf("Usage: %s <vfs_file>\n", argv[0]);
-        printf("Example: %s mydisk.vfs\n", argv[0]);
+        printf("Usage: %s [-c cache_clusters] [-m] <vfs_file>\n", argv[0]);
+        printf("Example: %s -c 1024 mydisk.vfs\n", argv[0]);
     }
 
     return 0;
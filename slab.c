@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+
+/*
+ * Fixed size object pools for the in-memory directory tree. Objects are cut from
+ * SLAB_SIZE blocks in order, so the items of a directory loaded in one go lie next
+ * to each other; freed objects go on a free list and are handed out first. Nothing
+ * is returned to malloc until slab_release() drops the whole pool.
+ */
+
+#define SLAB_HEADER sizeof(void *)     /* Link to the previous slab */
+
+void slab_init(slab_pool *pool, size_t object_size) {
+    memset(pool, 0, sizeof(slab_pool));
+    if (object_size < sizeof(void *)) object_size = sizeof(void *);
+    pool->object_size = (object_size + 7) & ~(size_t)7;
+    pool->per_slab = (int32_t)((SLAB_SIZE - SLAB_HEADER) / pool->object_size);
+}
+
+/*
+ * Returns a zeroed object, NULL when no memory is left
+ */
+void *slab_alloc(slab_pool *pool) {
+    void *object;
+
+    if (pool->free_list) {
+        object = pool->free_list;
+        pool->free_list = *(void **)object;
+    } else {
+        if (pool->cursor_left == 0) {
+            uint8_t *slab = malloc(SLAB_SIZE);
+            if (!slab) return NULL;
+            *(void **)slab = pool->slabs;
+            pool->slabs = slab;
+            pool->cursor = slab + SLAB_HEADER;
+            pool->cursor_left = pool->per_slab;
+        }
+        object = pool->cursor;
+        pool->cursor += pool->object_size;
+        pool->cursor_left--;
+    }
+
+    memset(object, 0, pool->object_size);
+    pool->in_use++;
+    return object;
+}
+
+void slab_free(slab_pool *pool, void *object) {
+    if (!object) return;
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+/*
+ * Frees every slab at once; all objects of the pool become invalid
+ */
+void slab_release(slab_pool *pool) {
+    void *slab = pool->slabs;
+    while (slab) {
+        void *previous = *(void **)slab;
+        free(slab);
+        slab = previous;
+    }
+    slab_init(pool, pool->object_size);
+}
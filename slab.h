@@ -0,0 +1,11 @@
+#ifndef FS_ON_INODE_SLAB_H
+#define FS_ON_INODE_SLAB_H
+
+#include "structures.h"
+
+void slab_init(slab_pool *pool, size_t object_size);
+void *slab_alloc(slab_pool *pool);
+void slab_free(slab_pool *pool, void *object);
+void slab_release(slab_pool *pool);
+
+#endif //FS_ON_INODE_SLAB_H
@@ -6,6 +6,7 @@
 #define FS_ON_INODE_STRUCTURES_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint-gcc.h>
 #include <stdbool.h>
 #include "constants.h"
@@ -16,15 +17,89 @@ typedef struct DIR_ITEM {
     int32_t inode;
 	char item_name[MAX_ITEM_NAME_LENGTH];
 	struct DIR_ITEM *next;
+    int32_t cluster;    // data cluster holding the on-disk entry, ID_ITEM_FREE when not stored
+    int32_t slot;       // entry number within that cluster
 } dir_item;
 
+typedef struct EXTENT {
+    int32_t start;      // first data cluster of the run
+    int32_t length;     // number of clusters in the run
+} extent;
+
+/*
+ * Open-addressing index over the names of all items of a directory
+ */
+typedef struct DIR_INDEX {
+    dir_item **slots;                   // NULL = never used, otherwise an item or a tombstone
+    int32_t capacity;                   // power of two, 0 until the first insert
+    int32_t count;
+    int32_t tombstones;
+} dir_index;
+
+/*
+ * Entries of one directory cluster in use, one bit per entry
+ */
+typedef struct DIR_SLOT_BLOCK {
+    int32_t cluster;
+    int32_t used;                       // entries taken
+    uint64_t bits[DIR_SLOT_WORDS];
+} dir_slot_block;
+
+/*
+ * Free entry map over all data clusters of a directory
+ */
+typedef struct DIR_SLOTS {
+    dir_slot_block *blocks;             // in no particular order
+    int32_t count, capacity;
+    int32_t free_count;                 // free entries over all blocks
+    int32_t hint;                       // blocks before this one have no free entry
+} dir_slots;
+
 typedef struct DIRECTORY {
     struct DIRECTORY *parent;
     dir_item *current;
     dir_item *subdir;
     dir_item *file;
+    dir_item *subdir_tail, *file_tail;  // last items of the lists, for appending
+    dir_index index;                    // names of subdir and file items
+    dir_slots slots;                    // free entries of the directory clusters
+    int32_t open_children;              // subdirs currently held in all_dirs; evictable only at 0
+    struct DIRECTORY *lru_prev, *lru_next;  // position among loaded directories, root is not listed
 } directory;
 
+/*
+ * Result of resolving a normalized absolute path to a directory
+ */
+typedef struct DENTRY {
+    char path[DCACHE_PATH_LENGTH];      // empty when the slot is unused
+    int32_t length;
+    directory *dir;                     // NULL when the path is known not to be a directory
+} dentry;
+
+typedef struct DENTRY_CACHE {
+    dentry *entries;                    // DCACHE_ENTRIES slots, indexed by the hash of the path
+    long hits, misses;
+} dentry_cache;
+
+/*
+ * Walk over the items of a directory, subdirs first. When sorted, pointers to all
+ * items are taken up front and ordered within each of the two groups.
+ */
+typedef struct DIR_ITER {
+    dir_item *next;                     // unsorted walk: next item of the current list
+    bool in_files;                      // unsorted walk: next comes from the file list
+    dir_item *file_head;                // unsorted walk: where the file list starts
+    dir_item **sorted;                  // NULL for the unsorted walk
+    int32_t subdir_count, count, pos;
+} dir_iter;
+
+typedef struct LS_OPTIONS {
+    bool long_format;                   // inode, type and size on each line
+    int order;                          // LS_ORDER_*
+    int32_t page_size;                  // entries per page, 0 = everything
+    int32_t page;                       // from 1
+} ls_options;
+
 typedef struct INODE {
     int32_t nodeid;
     bool isDirectory;
@@ -32,8 +107,28 @@ typedef struct INODE {
     int32_t file_size;
     int32_t direct1, direct2, direct3, direct4, direct5;
     int32_t indirect1, indirect2;
+    uint8_t flags;                      // INODE_FLAG_*
 } inode;
 
+_Static_assert(offsetof(inode, indirect2) + sizeof(int32_t) - offsetof(inode, direct1) == INLINE_DATA_SIZE,
+               "block map fields of an inline i-node must be contiguous");
+
+/*
+ * Inode as stored in the inode table, INODE_SIZE bytes, no padding between fields
+ */
+typedef struct __attribute__((packed)) INODE_DISK {
+    int32_t nodeid;
+    int8_t isDirectory;
+    int8_t references;
+    int32_t file_size;
+    int32_t direct1, direct2, direct3, direct4, direct5;
+    int32_t indirect1, indirect2;
+    uint8_t flags;                      // INODE_FLAG_*, 0 on images created before they existed
+    int8_t reserved;
+} inode_disk;
+
+_Static_assert(sizeof(inode_disk) == INODE_SIZE, "on-disk inode record must be INODE_SIZE bytes");
+
 typedef struct SUPERBLOCK {
     char signature[SIGNATURE_LENGTH];
 
@@ -47,17 +142,143 @@ typedef struct SUPERBLOCK {
     int32_t bitmap_start_address;   // Start address of the bitmap of the data blocks
     int32_t inode_start_address;    // Start address of the i-nodes
     int32_t data_start_address;     // Start address of data blocks
+    int32_t features;               // FEATURE_* flags, 0 on images created before they existed
+    int32_t free_hint;              // Data block where the next free block search starts
+    int32_t inode_bitmap_cluster_count; // Count of clusters for the inode bitmap, 0 without FEATURE_INODE_BITMAP
+    int32_t inode_bitmap_start_address; // Start address of the bitmap of the i-nodes
+    int32_t free_inode_count;       // Count of unused i-nodes
+    int32_t inode_hint;             // I-node where the next free inode search starts
+    int32_t refcount_cluster_count; // Count of clusters for the cluster reference counts, 0 without FEATURE_REFCOUNTS
+    int32_t refcount_start_address; // Start address of the reference counts, one uint16_t per data cluster
+    int32_t dedup_cluster_count;    // Count of clusters for the deduplication index, 0 without FEATURE_DEDUP_INDEX
+    int32_t dedup_start_address;    // Start address of the deduplication index, a power of two of dedup_entry
 } superblock;
 
+/* Stored as is, the fields must not be padded */
+_Static_assert(sizeof(superblock) == SIGNATURE_LENGTH + 20 * sizeof(int32_t), "superblock must not be padded");
+
+/*
+ * Entry of the deduplication index; the low bits of the cluster hash choose a
+ * set of DEDUP_WAYS entries
+ */
+typedef struct DEDUP_ENTRY {
+    uint64_t hash;
+    int32_t cluster;                    // data cluster with this hash, EMPTY_ADDRESS when the bucket is empty
+    int32_t reserved;
+} dedup_entry;
+
+_Static_assert(sizeof(dedup_entry) == 16, "deduplication index entries must not be padded");
+
+typedef struct CACHE_ENTRY {
+    int32_t cluster;                    // data cluster held by this entry, ID_ITEM_FREE when unused
+    bool dirty;                         // must be written back before eviction
+    uint8_t *data;                      // CLUSTER_SIZE bytes
+    struct CACHE_ENTRY *prev, *next;    // LRU list, head is most recently used
+    struct CACHE_ENTRY *hash_next;      // bucket chain
+} cache_entry;
+
+typedef struct BLOCK_CACHE {
+    int32_t capacity;                   // number of clusters kept in memory
+    int32_t used;                       // entries handed out so far
+    int32_t bucket_count;               // power of two
+    cache_entry *entries;
+    cache_entry **buckets;
+    cache_entry *lru_head, *lru_tail;
+    uint8_t *memory;                    // capacity * CLUSTER_SIZE bytes backing all entries
+    long hits, misses, writebacks;
+} block_cache;
+
+/*
+ * Cursor over the block map of one inode: direct blocks, then the packed list in
+ * indirect1, then the packed lists referenced from indirect2. Indirect clusters are
+ * copied in whole when entered, so the walk is not affected by cache evictions.
+ */
+typedef struct BLOCK_ITER {
+    int32_t direct[5];
+    int32_t indirect1, indirect2;
+    int stage;                          // BLOCK_ITER_DIRECT, BLOCK_ITER_INDIRECT1, ...
+    int pos;                            // next slot of direct[] or refs[]
+    int outer_pos;                      // next slot of outer[]
+    int32_t refs[INT32_COUNT_IN_BLOCK]; // packed list being walked
+    int32_t outer[INT32_COUNT_IN_BLOCK];// first level of indirect2
+    bool has_pending;                   // pending was read ahead by block_iter_next_run()
+    int32_t pending;
+} block_iter;
+
+/*
+ * Pool of equally sized objects carved from SLAB_SIZE blocks
+ */
+typedef struct SLAB_POOL {
+    size_t object_size;                 // rounded up to a multiple of 8
+    int32_t per_slab;
+    void *slabs;                        // allocated slabs, linked through their first word
+    void *free_list;                    // freed objects, linked through their first word
+    uint8_t *cursor;                    // next never used object of the newest slab
+    int32_t cursor_left;
+    int32_t in_use;
+} slab_pool;
+
+/*
+ * Inode and clusters taken for a file whose data is still to be written
+ */
+typedef struct FILE_RESERVATION {
+    int32_t id;                         // inode, ID_ITEM_FREE when none is held
+    int64_t size;
+    int32_t *blocks;                    // data blocks in file order, the indirect ones, the spare ones
+    int32_t data_count;
+    int32_t meta_count;
+    int32_t spare_count;                // taken but left unused by compression
+    uint8_t *meta_data;                 // contents of the indirect clusters
+    bool inline_data;                   // contents go into the i-node, no clusters are held
+    bool compressed;                    // data is stored in compressed groups
+    uint64_t *hashes;                   // hash of every data block when it is deduplicated, else NULL
+    uint8_t inline_bytes[INLINE_DATA_SIZE];
+} file_reservation;
+
+typedef struct BLOCK_MAP {
+    int32_t *blocks;                    // data blocks in file order
+    int32_t count;
+} block_map;
+
+typedef struct VFS_OPTIONS {
+    int32_t cache_clusters;             // capacity of the data cluster cache
+    bool use_mmap;                      // access the image through a shared mapping instead of stdio
+} vfs_options;
+
 typedef struct vfs {
     superblock *superblock;
     inode *inodes;
-    int8_t *data_bitmap;
+    uint64_t *data_bitmap;              // one bit per cluster, 1 = used
+    uint64_t *inode_bitmap;             // one bit per inode, 1 = used; always a private copy
+    uint16_t *refcounts;                // per data cluster, owners beyond the first; NULL without FEATURE_REFCOUNTS
+    dedup_entry *dedup_index;           // NULL without FEATURE_DEDUP_INDEX
+    int32_t *dedup_slots;               // per data cluster, its bucket in dedup_index + 1, 0 when not indexed
+    int32_t dedup_saved;                // clusters freed by deduplication, reset by the command reporting them
     bool is_formatted;
     directory *current_dir;
-    directory **all_dirs;
+    directory **all_dirs;               // loaded directories by inode, filled on first use
+    directory *dir_lru_head, *dir_lru_tail; // most / least recently used loaded directory
+    int32_t loaded_dir_count;
     char *name;
     FILE *vfs_file;
+    block_cache *cache;
+    dentry_cache *dcache;               // resolved directory paths
+    slab_pool item_pool;                // dir_item nodes
+    slab_pool dir_pool;                 // directory nodes
+    bool use_mmap;
+    uint8_t *map;                       // whole image when use_mmap is set, NULL otherwise
+    size_t map_size;
+    long map_pos;                       // cursor for seek_set/vfs_read/write_vfs on the mapping
+    bool bitmap_mapped;                 // data_bitmap points into the mapping
+    bool *dirty_inode_pages;            // per INODES_PER_CLUSTER records, written on vfs_commit()
+    bool *dirty_bitmap_pages;           // per CLUSTER_SIZE bitmap bytes, written on vfs_commit()
+    bool *dirty_inode_bitmap_pages;     // same for the inode bitmap
+    bool *dirty_refcount_pages;         // same for the reference counts
+    bool *dirty_dedup_pages;            // same for the deduplication index
+    int32_t dirty_page_count;
+    bool superblock_dirty;
+    block_map **block_maps;             // per inode, built by blockmap_get() and dropped when the inode changes
+    int32_t block_map_count;
 } VFS;
 
 
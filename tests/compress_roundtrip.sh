@@ -0,0 +1,40 @@
+#!/bin/sh
+# Files imported with incp -z, or on a volume formatted with -z, are stored
+# compressed and read back unchanged; every check runs on a re-opened image.
+# Usage: tests/compress_roundtrip.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+seq 1 60000 > "$WORK/text"
+head -c 100000 /dev/urandom > "$WORK/random"
+head -c 5000 "$WORK/text" > "$WORK/head"
+{ cat "$WORK/text"; head -c 30000 /dev/zero; } > "$WORK/grown"
+: > "$WORK/empty"
+
+vfs_format 100000000
+vfs "incp -z $WORK/text t" "incp -z $WORK/random r" "incp -z $WORK/empty e"
+vfs "info t"
+expect_output "Compressed:" "compressible text"
+expect_file t "$WORK/text" "compressed text"
+expect_file r "$WORK/random" "incompressible data"
+expect_file e "$WORK/empty" "empty file"
+vfs "cat t"
+expect_output "^31337$" "cat of a compressed file"
+
+# A copy shares the compressed clusters, resizing it decodes its own contents
+vfs "cp t c"
+vfs "size $(inode_of c) 5000"
+expect_file c "$WORK/head" "truncated copy"
+expect_file t "$WORK/text" "source after truncating the copy"
+vfs "size $(inode_of t) $(($(wc -c < "$WORK/text") + 30000))"
+expect_file t "$WORK/grown" "extended source"
+
+# A volume formatted with -z compresses a plain incp
+vfs_format 100000000 -z
+vfs "incp $WORK/text t"
+vfs "info t"
+expect_output "Compressed:" "default compression"
+expect_file t "$WORK/text" "text on a compressed volume"
+
+finish compress_roundtrip
@@ -0,0 +1,34 @@
+#!/bin/sh
+# cp shares the data clusters of the source. Resizing either file afterwards must
+# leave the other as it was; every check runs on a re-opened image.
+# Usage: tests/cp_cow.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+head -c 300000 /dev/urandom > "$WORK/src"
+head -c 5000 "$WORK/src" > "$WORK/head"
+{ cat "$WORK/head"; head -c 95000 /dev/zero; } > "$WORK/grown"
+
+vfs_format 100000000
+vfs "incp $WORK/src a" "cp a b" "cp b c"
+expect_file a "$WORK/src" "source"
+expect_file b "$WORK/src" "copy"
+
+# Truncate the source into the middle of a shared cluster, then extend it with a hole
+vfs "size $(inode_of a) 5000"
+expect_file a "$WORK/head" "truncated source"
+expect_file b "$WORK/src" "copy after source truncation"
+vfs "size $(inode_of a) 100000"
+expect_file a "$WORK/grown" "extended source"
+expect_file b "$WORK/src" "copy after source extension"
+
+# Resizing a copy leaves the other copy and the source alone
+vfs "size $(inode_of b) 5000"
+expect_file b "$WORK/head" "truncated copy"
+expect_file c "$WORK/src" "second copy"
+
+vfs "rm a" "rm b"
+expect_file c "$WORK/src" "last sharer"
+
+finish cp_cow
@@ -0,0 +1,33 @@
+#!/bin/sh
+# dedup and incp -d share identical clusters between files; removing one sharer
+# must leave the others intact. Every check runs on a re-opened image.
+# Usage: tests/dedup_rm.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+# 49 clusters, the copy differs from the source only in cluster 24
+head -c 200000 /dev/urandom > "$WORK/a"
+cp "$WORK/a" "$WORK/b"
+printf 'XXXX' | dd of="$WORK/b" bs=1 seek=100000 conv=notrunc 2> /dev/null
+
+vfs_format 100000000
+vfs "incp $WORK/a a" "incp $WORK/b b"
+vfs "dedup"
+expect_output "Deduplicated 48 clusters" "first dedup"
+vfs "dedup"
+expect_output "Deduplicated 0 clusters" "second dedup"
+expect_file a "$WORK/a" "source after dedup"
+expect_file b "$WORK/b" "modified copy after dedup"
+
+vfs "rm a"
+expect_file b "$WORK/b" "modified copy after removing the source"
+
+# Importing the source again shares everything but the modified cluster
+vfs "incp -d $WORK/a c"
+expect_output "Deduplicated 48 clusters" "incp -d"
+expect_file c "$WORK/a" "deduplicated import"
+vfs "rm b"
+expect_file c "$WORK/a" "deduplicated import after removing the last sharer"
+
+finish dedup_rm
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Directory growth past its direct clusters (256 entries each) and the first
+# indirect list: imports directories of tiny files, reloads the image and checks
+# every entry is listed, then removes them and the directory again.
+# Usage: tests/dir_reload.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+status=0
+
+for count in 1600 1800; do
+    rm -f "$WORK/vfs.img"
+    mkdir -p "$WORK/d$count"
+    i=1
+    while [ $i -le $count ]; do
+        printf 'x%d' $i > "$WORK/d$count/f$i"
+        i=$((i + 1))
+    done
+
+    printf 'n\nformat 100000000\nincp -r %s d\nexit\n' "$WORK/d$count" | "$BIN" "$WORK/vfs.img" > "$WORK/out" 2>&1
+    if ! grep -q "Imported $count files, created 0 directories, 0 failed" "$WORK/out"; then
+        echo "FAIL $count: import"
+        status=1
+        continue
+    fi
+
+    listed=$(printf 'ls d\nexit\n' | "$BIN" "$WORK/vfs.img" 2>&1 | grep -c "FILE: f[0-9]")
+    if [ "$listed" -ne "$count" ]; then
+        echo "FAIL $count: $listed entries after reload"
+        status=1
+        continue
+    fi
+
+    (echo "cd d"; i=1; while [ $i -le $count ]; do echo "rm f$i"; i=$((i + 1)); done; echo "cd .."; echo "rmdir d"; echo exit) \
+        | "$BIN" "$WORK/vfs.img" > /dev/null 2>&1 || { echo "FAIL $count: removal"; status=1; continue; }
+    if printf 'ls\nexit\n' | "$BIN" "$WORK/vfs.img" 2>&1 | grep -q "DIR: d"; then
+        echo "FAIL $count: directory left after rmdir"
+        status=1
+        continue
+    fi
+    echo "OK $count"
+done
+
+exit $status
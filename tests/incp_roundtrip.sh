@@ -0,0 +1,26 @@
+#!/bin/sh
+# Streaming incp: files around the direct, indirect1 and indirect2 limits are
+# imported, then exported from a re-opened image and compared byte for byte.
+# Usage: tests/incp_roundtrip.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+vfs_format 100000000
+vfs "mkdir sub"
+
+# 0 B, inside one cluster, 5 direct clusters, one past them, past indirect1
+for size in 0 5000 20480 20481 4218881; do
+    head -c $size /dev/urandom > "$WORK/f$size"
+    vfs "incp $WORK/f$size sub/f$size"
+done
+
+for size in 0 5000 20480 20481 4218881; do
+    expect_file sub/f$size "$WORK/f$size" "after reload"
+done
+
+# Into an existing directory under the host name
+vfs "mkdir dest" "incp $WORK/f5000 dest"
+expect_file dest/f5000 "$WORK/f5000" "directory destination"
+
+finish incp_roundtrip
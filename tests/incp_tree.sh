@@ -0,0 +1,40 @@
+#!/bin/sh
+# Recursive incp on the worker pool: a host tree of files of mixed sizes is
+# imported, then every file is exported from a re-opened image and compared.
+# Usage: tests/incp_tree.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+TREE="$WORK/tree"
+mkdir -p "$TREE/a/b/c" "$TREE/d" "$TREE/empty"
+i=0
+for dir in "$TREE" "$TREE/a" "$TREE/a/b" "$TREE/a/b/c" "$TREE/d"; do
+    for size in 0 13 28 29 4096 5000 70000 300000; do
+        i=$((i + 1))
+        head -c $size /dev/urandom > "$dir/f$i"
+    done
+done
+
+vfs_format 100000000
+vfs "incp -r $TREE t"
+expect_output "Imported $i files, created 5 directories, 0 failed" "import summary"
+
+mkdir "$WORK/out_tree"
+cmds=""
+for path in $(cd "$TREE" && find . -type f | sed 's|^\./||'); do
+    cmds="$cmds
+outcp t/$path $WORK/out_tree/$(echo "$path" | tr / _)"
+done
+vfs "$cmds"
+for path in $(cd "$TREE" && find . -type f | sed 's|^\./||'); do
+    if ! cmp -s "$TREE/$path" "$WORK/out_tree/$(echo "$path" | tr / _)"; then
+        echo "FAIL: t/$path differs"
+        status=1
+    fi
+done
+
+vfs "ls t/empty"
+expect_output "Directories:" "empty directory"
+
+finish incp_tree
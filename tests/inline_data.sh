@@ -0,0 +1,51 @@
+#!/bin/sh
+# Files of at most 28 bytes live in their i-node; size promotes them to a
+# cluster and demotes them back. Every check runs on a re-opened image.
+# Usage: tests/inline_data.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+printf 'hello, world\n' > "$WORK/s13"
+head -c 28 /dev/urandom > "$WORK/s28"
+head -c 29 /dev/urandom > "$WORK/s29"
+{ cat "$WORK/s13"; head -c 4987 /dev/zero; } > "$WORK/grown"
+head -c 10 "$WORK/s13" > "$WORK/head"
+
+vfs_format 10000000
+vfs "incp $WORK/s13 a" "incp $WORK/s28 b" "incp $WORK/s29 c" "cp a d"
+vfs "info a"
+expect_output "Inline: 13 B" "13-byte file"
+vfs "info b"
+expect_output "Inline: 28 B" "28-byte file"
+vfs "info c"
+expect_no_output "Inline" "29-byte file"
+expect_file a "$WORK/s13" "13-byte file"
+expect_file b "$WORK/s28" "28-byte file"
+expect_file c "$WORK/s29" "29-byte file"
+vfs "cat a"
+expect_output "hello, world" "cat of an inline file"
+
+# Growing past the i-node moves the contents to a cluster
+vfs "size $(inode_of a) 5000"
+vfs "info a"
+expect_no_output "Inline" "promoted file"
+expect_file a "$WORK/grown" "promoted file"
+expect_file d "$WORK/s13" "copy of the promoted file"
+
+# Shrinking back into the i-node frees the cluster
+vfs "size $(inode_of a) 10"
+vfs "info a"
+expect_output "Inline: 10 B" "demoted file"
+expect_file a "$WORK/head" "demoted file"
+
+# An empty directory takes no cluster until its first entry
+vfs "mkdir e"
+vfs "info e"
+expect_output "Direct: NONE" "empty directory"
+vfs "incp $WORK/s29 e/f"
+expect_file e/f "$WORK/s29" "file in a formerly empty directory"
+vfs "info e"
+expect_no_output "Direct: NONE" "directory with an entry"
+
+finish inline_data
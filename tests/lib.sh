@@ -0,0 +1,56 @@
+# Helpers of the round-trip tests, sourced with BIN set to the binary under test.
+# Every vfs call starts the binary again, so each step re-opens the image.
+
+WORK=$(mktemp -d)
+IMG="$WORK/vfs.img"
+trap 'rm -rf "$WORK"' EXIT
+status=0
+
+# Runs the given shell commands (one per argument) on the image, output in $WORK/out
+vfs() {
+    printf '%s\n' "$@" exit | "$BIN" "$IMG" > "$WORK/out" 2>&1
+}
+
+# Creates the image, answering the prompt for a missing one
+vfs_format() {
+    rm -f "$IMG"
+    printf 'n\nformat %s\nexit\n' "$*" | "$BIN" "$IMG" > "$WORK/out" 2>&1
+}
+
+# Prints the i-node of path
+inode_of() {
+    vfs "info $1"
+    sed -n 's/^.*i-node: \([0-9]*\).*$/\1/p' "$WORK/out" | head -n 1
+}
+
+# Exports path and compares it with the expected host file
+expect_file() {
+    rm -f "$WORK/export"
+    vfs "outcp $1 $WORK/export"
+    if ! cmp -s "$WORK/export" "$2"; then
+        echo "FAIL: $1 differs from $2 ($3)"
+        status=1
+    fi
+}
+
+# Checks that the output of the last vfs call contains text
+expect_output() {
+    if ! grep -q -- "$1" "$WORK/out"; then
+        echo "FAIL: no '$1' ($2)"
+        status=1
+    fi
+}
+
+# Checks that the output of the last vfs call does not contain text
+expect_no_output() {
+    if grep -q -- "$1" "$WORK/out"; then
+        echo "FAIL: unexpected '$1' ($2)"
+        status=1
+    fi
+}
+
+# Prints the summary line and exits with the collected status
+finish() {
+    [ $status -eq 0 ] && echo "OK $1"
+    exit $status
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# size truncates a file or extends it with a hole that reads as zeros and takes
+# no clusters; every check runs on a re-opened image.
+# Usage: tests/size_holes.sh [binary]
+
+BIN=${1:-./fs-on-inode}
+. "$(dirname "$0")/lib.sh"
+
+head -c 9000 /dev/urandom > "$WORK/src"
+head -c 3000 "$WORK/src" > "$WORK/head"
+{ cat "$WORK/head"; head -c 97000 /dev/zero; } > "$WORK/grown"
+{ cat "$WORK/head"; head -c 49997000 /dev/zero; } > "$WORK/huge"
+: > "$WORK/empty"
+
+# The volume is too small to hold the largest size unless the tail is a hole
+vfs_format 10000000
+vfs "incp $WORK/src a"
+id=$(inode_of a)
+expect_file a "$WORK/src" "source"
+
+# Truncate into the middle of a cluster, then extend past the old end
+vfs "size $id 3000"
+expect_file a "$WORK/head" "truncated"
+vfs "size $id 100000"
+expect_file a "$WORK/grown" "extended"
+vfs "size $id 50000000"
+expect_output "OK" "extension beyond the volume size"
+expect_file a "$WORK/huge" "extended beyond the volume size"
+
+# The hole left the free clusters alone
+vfs "incp $WORK/src b"
+expect_file b "$WORK/src" "file written after the extension"
+
+vfs "size $id 0"
+expect_file a "$WORK/empty" "truncated to zero"
+vfs "info a"
+expect_output "Direct: NONE" "no clusters after truncation to zero"
+expect_file b "$WORK/src" "other file after truncation"
+
+finish size_holes
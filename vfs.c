@@ -10,8 +10,18 @@
 #include "constants.h"
 #include "commands.h"
 #include "helpers.h"
-
-void initialize_vfs(VFS **vfs, char *vfs_name) {
+#include "cache.h"
+#include "blockmap.h"
+#include "dirindex.h"
+#include "dirslots.h"
+#include "dcache.h"
+#include "dirscan.h"
+#include "slab.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void initialize_vfs(VFS **vfs, char *vfs_name, vfs_options *options) {
     *vfs = calloc(1, sizeof(VFS));
 
     if (!*vfs) {
@@ -20,6 +30,16 @@ void initialize_vfs(VFS **vfs, char *vfs_name) {
     }
 
     (*vfs)->name = strdup(vfs_name);
+    (*vfs)->cache = cache_create(options ? options->cache_clusters : BLOCK_CACHE_CLUSTERS);
+    (*vfs)->dcache = dcache_create();
+    slab_init(&(*vfs)->item_pool, sizeof(dir_item));
+    slab_init(&(*vfs)->dir_pool, sizeof(directory));
+    if (!(*vfs)->cache || !(*vfs)->dcache) {
+        printf(MEMORY_ERROR_MSG);
+        exit(1);
+    }
+
+    (*vfs)->use_mmap = options && options->use_mmap;
 
     FILE *file = fopen(vfs_name, "rb+");
     if (file == NULL) {
@@ -75,25 +95,46 @@ bool load_vfs(VFS **vfs) {
         return false;
     }
 
-    (*vfs)->data_bitmap = calloc((*vfs)->superblock->cluster_count, sizeof(int8_t));
-    if (!(*vfs)->data_bitmap) {
+    /* Mapped once the superblock gives the image size, stdio when that fails */
+    if ((*vfs)->use_mmap && !vfs_map_image(vfs)) {
+        printf(MMAP_ERROR_MSG);
+        (*vfs)->use_mmap = false;
+    }
+
+    if (!((*vfs)->superblock->features & FEATURE_PACKED_BITMAP) && !vfs_upgrade_bitmap(vfs)) {
         printf(MEMORY_ERROR_MSG);
         return false;
     }
 
+    if ((*vfs)->map) {
+        (*vfs)->data_bitmap = (uint64_t *)((*vfs)->map + (*vfs)->superblock->bitmap_start_address);
+        (*vfs)->bitmap_mapped = true;
+    } else {
+        (*vfs)->data_bitmap = calloc(bitmap_word_count(vfs), sizeof(uint64_t));
+        if (!(*vfs)->data_bitmap) {
+            printf(MEMORY_ERROR_MSG);
+            return false;
+        }
 
-    vfs_seek_from_start(vfs, (*vfs)->superblock->bitmap_start_address);
-    vfs_read(vfs, (*vfs)->data_bitmap, sizeof(int8_t), (*vfs)->superblock->cluster_count);
+        vfs_seek_from_start(vfs, (*vfs)->superblock->bitmap_start_address);
+        vfs_read(vfs, (*vfs)->data_bitmap, sizeof(uint64_t), bitmap_word_count(vfs));
+    }
 
     (*vfs)->inodes = calloc((*vfs)->superblock->inode_count, sizeof(inode));
-    if (!(*vfs)->inodes) {
+    if (!(*vfs)->inodes || !vfs_init_dirty_sets(vfs)) {
         printf(MEMORY_ERROR_MSG);
         return false;
     }
 
 
-    for (int i = 0; i < (*vfs)->superblock->inode_count; i++) {
-        vfs_read_inodes(vfs, i);
+    if (!vfs_read_inodes(vfs)) {
+        printf(ERROR_INODES_READING);
+        return false;
+    }
+
+    if (!vfs_load_inode_bitmap(vfs) || !vfs_load_refcounts(vfs) || !vfs_load_dedup_index(vfs)) {
+        printf(MEMORY_ERROR_MSG);
+        return false;
     }
 
 
@@ -103,13 +144,13 @@ bool load_vfs(VFS **vfs) {
         return false;
     }
 
-    directory *root = calloc(1, sizeof(directory));
-    if (!root) {
+    directory *root = vfs_alloc_directory(vfs);
+    dir_item *root_item = create_directory_item(vfs, 0, "/");
+    if (!root || !root_item) {
         printf(MEMORY_ERROR_MSG);
         return false;
     }
 
-    dir_item *root_item = create_directory_item(0, "/");
     root->current = root_item;
     root->parent = root;
     root->subdir = NULL;
@@ -147,192 +188,563 @@ bool vfs_read_sb(VFS **vfs) {
     vfs_read_int32(vfs, &(*vfs)->superblock->bitmap_start_address);
     vfs_read_int32(vfs, &(*vfs)->superblock->inode_start_address);
     vfs_read_int32(vfs, &(*vfs)->superblock->data_start_address);
+    vfs_read_int32(vfs, &(*vfs)->superblock->features);
+    vfs_read_int32(vfs, &(*vfs)->superblock->free_hint);
+    vfs_read_int32(vfs, &(*vfs)->superblock->inode_bitmap_cluster_count);
+    vfs_read_int32(vfs, &(*vfs)->superblock->inode_bitmap_start_address);
+    vfs_read_int32(vfs, &(*vfs)->superblock->free_inode_count);
+    vfs_read_int32(vfs, &(*vfs)->superblock->inode_hint);
+    vfs_read_int32(vfs, &(*vfs)->superblock->refcount_cluster_count);
+    vfs_read_int32(vfs, &(*vfs)->superblock->refcount_start_address);
+    vfs_read_int32(vfs, &(*vfs)->superblock->dedup_cluster_count);
+    vfs_read_int32(vfs, &(*vfs)->superblock->dedup_start_address);
+
+    /* Records past the inode region would lie in the data clusters, such tables are cut to the region */
+    int32_t region_inodes = (*vfs)->superblock->inode_cluster_count * INODES_PER_CLUSTER;
+    if ((*vfs)->superblock->inode_count > region_inodes) {
+        (*vfs)->superblock->inode_count = region_inodes;
+        (*vfs)->superblock_dirty = true;
+    }
+
+    /* Older images have no inode bitmap region, the bitmap is then kept in memory only */
+    if (!((*vfs)->superblock->features & FEATURE_INODE_BITMAP)) {
+        (*vfs)->superblock->inode_bitmap_cluster_count = 0;
+        (*vfs)->superblock->inode_bitmap_start_address = 0;
+    }
+    /* Nor reference counts; clusters are then never shared */
+    if (!((*vfs)->superblock->features & FEATURE_REFCOUNTS)) {
+        (*vfs)->superblock->refcount_cluster_count = 0;
+        (*vfs)->superblock->refcount_start_address = 0;
+    }
+    /* Nor a deduplication index, which also needs the reference counts */
+    if (!((*vfs)->superblock->features & FEATURE_DEDUP_INDEX) || !((*vfs)->superblock->features & FEATURE_REFCOUNTS)) {
+        (*vfs)->superblock->dedup_cluster_count = 0;
+        (*vfs)->superblock->dedup_start_address = 0;
+    }
 
 
     return true;
 }
 
-void vfs_read_inodes(VFS **vfs, int index) {
-    long base = (*vfs)->superblock->inode_start_address + (long)index * INODE_SIZE;
-    vfs_seek_from_start(vfs, base);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].nodeid);
-    vfs_read_int8 (vfs, &(*vfs)->inodes[index].isDirectory);
-    vfs_read_int8 (vfs, &(*vfs)->inodes[index].references);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].file_size);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].direct1);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].direct2);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].direct3);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].direct4);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].direct5);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].indirect1);
-    vfs_read_int32(vfs, &(*vfs)->inodes[index].indirect2);
+/*
+ * Converts the bitmap of an image created with one byte per cluster to one bit per
+ * cluster. The packed bitmap is stored at the start of the old bitmap region.
+ */
+bool vfs_upgrade_bitmap(VFS **vfs) {
+    superblock *sb = (*vfs)->superblock;
+    int8_t *bytes = calloc(sb->cluster_count, sizeof(int8_t));
+    uint8_t *packed = calloc(sb->cluster_count, sizeof(uint8_t)); /* Zeroes the rest of the old region too */
+    if (!bytes || !packed) {
+        free(bytes);
+        free(packed);
+        return false;
+    }
+
+    printf(BITMAP_UPGRADE_MSG);
+    vfs_seek_from_start(vfs, sb->bitmap_start_address);
+    vfs_read(vfs, bytes, sizeof(int8_t), sb->cluster_count);
+
+    for (int32_t i = 0; i < sb->cluster_count; i++) {
+        if (bytes[i]) packed[i / 8] |= (uint8_t)(1u << (i % 8));
+    }
+    vfs_pwrite(vfs, packed, sb->cluster_count, sb->bitmap_start_address);
+
+    sb->features |= FEATURE_PACKED_BITMAP;
+    sb->free_hint = 1;
+    vfs_store_superblock(vfs);
+    flush_vfs(vfs);
+
+    free(bytes);
+    free(packed);
+    return true;
 }
 
+void inode_decode(const inode_disk *record, inode *node) {
+    node->nodeid = record->nodeid;
+    node->isDirectory = record->isDirectory != 0;
+    node->references = record->references;
+    node->file_size = record->file_size;
+    node->direct1 = record->direct1;
+    node->direct2 = record->direct2;
+    node->direct3 = record->direct3;
+    node->direct4 = record->direct4;
+    node->direct5 = record->direct5;
+    node->indirect1 = record->indirect1;
+    node->indirect2 = record->indirect2;
+    node->flags = record->flags;
+}
 
-bool vfs_load_directories(VFS **vfs, directory *root) {
-    if (!vfs || !*vfs || !root) return false;
-    return load_directory_from_vfs(vfs, root, root->current->inode);
+void inode_encode(const inode *node, inode_disk *record) {
+    record->nodeid = node->nodeid;
+    record->isDirectory = node->isDirectory ? 1 : 0;
+    record->references = node->references;
+    record->file_size = node->file_size;
+    record->direct1 = node->direct1;
+    record->direct2 = node->direct2;
+    record->direct3 = node->direct3;
+    record->direct4 = node->direct4;
+    record->direct5 = node->direct5;
+    record->indirect1 = node->indirect1;
+    record->indirect2 = node->indirect2;
+    record->flags = node->flags;
+    record->reserved = 0;
 }
 
-bool load_directory_from_vfs(VFS **vfs, directory *dir, int inode_id) {
-    if (!vfs || !*vfs || !dir) return false;
+/*
+ * Contents of an inline i-node, INLINE_DATA_SIZE bytes over its block map fields
+ */
+uint8_t *inode_inline_data(inode *node) {
+    return (uint8_t *) &node->direct1;
+}
 
-    int block_count = 0;
-    int32_t *data_blocks = get_data_blocks(vfs, inode_id, &block_count, NULL);
-    if (!data_blocks || block_count <= 0) {
-        free(data_blocks);
+/*
+ * Whether files on this image may keep their contents in the i-node
+ */
+bool vfs_inline_enabled(VFS **vfs) {
+    return ((*vfs)->superblock->features & FEATURE_INLINE_DATA) != 0;
+}
+
+/*
+ * Whether new files on this image are stored compressed
+ */
+bool vfs_compress_enabled(VFS **vfs) {
+    return ((*vfs)->superblock->features & FEATURE_COMPRESSION) != 0;
+}
+
+/*
+ * Loads the whole inode table with sequential reads of INODE_IO_BATCH records
+ */
+bool vfs_read_inodes(VFS **vfs) {
+    int32_t count = (*vfs)->superblock->inode_count;
+
+    if ((*vfs)->map) {
+        const inode_disk *table = (const inode_disk *)((*vfs)->map + (*vfs)->superblock->inode_start_address);
+        for (int32_t i = 0; i < count; i++) {
+            inode_decode(&table[i], &(*vfs)->inodes[i]);
+        }
         return true;
     }
 
-    dir_item **last_subdir = &dir->subdir;
-    dir_item **last_file = &dir->file;
+    inode_disk *batch = malloc(INODE_IO_BATCH * sizeof(inode_disk));
+    if (!batch) {
+        printf(MEMORY_ERROR_MSG);
+        return false;
+    }
 
-    for (int i = 0; i < block_count; i++) {
-        seek_data_cluster(vfs, data_blocks[i]);
+    vfs_seek_from_start(vfs, (*vfs)->superblock->inode_start_address);
+    for (int32_t done = 0; done < count; ) {
+        int32_t n = count - done < INODE_IO_BATCH ? count - done : INODE_IO_BATCH;
+        if (vfs_read(vfs, batch, sizeof(inode_disk), n) != (size_t)n) {
+            free(batch);
+            return false;
+        }
+        for (int32_t i = 0; i < n; i++) {
+            inode_decode(&batch[i], &(*vfs)->inodes[done + i]);
+        }
+        done += n;
+    }
 
-        for (int j = 0; j < MAX_DIR_ENTRIES_PER_CLUSTER; j++) {
-            int32_t node_id;
-            char filename[MAX_ITEM_NAME_LENGTH] = {0};
+    free(batch);
+    return true;
+}
 
-            if (!vfs_read_int32(vfs, &node_id)) break;
-            if (!vfs_read(vfs, filename, sizeof(filename), 1)) break;
 
-            if (node_id <= 0) continue;
+/*
+ * Loads the root at mount, the other directories are loaded by vfs_open_directory() on first use
+ */
+bool vfs_load_directories(VFS **vfs, directory *root) {
+    if (!vfs || !*vfs || !root) return false;
+    return load_directory_from_vfs(vfs, root, root->current->inode);
+}
 
-            dir_item *item = create_directory_item(node_id, filename);
-            if (!item) continue;
+/*
+ * Reads the entries of one directory into its lists, name index and free entry map
+ */
+bool load_directory_from_vfs(VFS **vfs, directory *dir, int inode_id) {
+    if (!vfs || !*vfs || !dir) return false;
+
+    block_iter it;
+    int32_t block;
+
+    block_iter_init(vfs, &it, inode_id);
+    while (block_iter_next(vfs, &it, &block)) {
+        uint8_t *cluster = cache_get_cluster(vfs, block);
+        if (!cluster) continue;
+
+        /* Only entries in use are decoded, the rest of the cluster is skipped by the mask */
+        uint64_t used[DIR_SLOT_WORDS];
+        dirscan_used_mask(cluster, used);
+
+        for (int w = 0; w < DIR_SLOT_WORDS; w++) {
+            for (uint64_t bits = used[w]; bits; bits &= bits - 1) {
+                int j = w * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+                uint8_t *entry = cluster + j * DIR_ENTRY_SIZE;
+                int32_t node_id;
+                char filename[MAX_ITEM_NAME_LENGTH];
+
+                memcpy(&node_id, entry, sizeof(int32_t));
+                if (node_id >= (*vfs)->superblock->inode_count) {
+                    used[w] &= ~(1ULL << (j % BITMAP_WORD_BITS));    /* Garbage, reusable */
+                    continue;
+                }
+                memcpy(filename, entry + sizeof(int32_t), MAX_ITEM_NAME_LENGTH);
 
-            if ((*vfs)->inodes[node_id].isDirectory) {
-                *last_subdir = item;
-                last_subdir = &item->next;
-            } else {
-                *last_file = item;
-                last_file = &item->next;
+                dir_item *item = create_directory_item(vfs, node_id, filename);
+                if (!item) continue;
+                item->cluster = block;
+                item->slot = j;
+
+                if (!directory_add_item(dir, item, (*vfs)->inodes[node_id].isDirectory)) {
+                    free_directory_item(vfs, item);
+                    printf(MEMORY_ERROR_MSG);
+                    return false;
+                }
             }
         }
-    }
 
-    free(data_blocks);
-
-    for (dir_item *sub = dir->subdir; sub; sub = sub->next) {
-        directory *new_dir = calloc(1, sizeof(directory));
-        if (!new_dir) {
+        if (!dir_slots_add_block(&dir->slots, block, used)) {
             printf(MEMORY_ERROR_MSG);
             return false;
         }
+    }
+    return true;
+}
 
-        new_dir->parent = dir;
-        new_dir->current = sub;
-        (*vfs)->all_dirs[sub->inode] = new_dir;
+/*
+ * Looks up name in the raw clusters of a directory inode without loading it.
+ * Returns the inode of the entry and its position, or ID_ITEM_FREE.
+ */
+int32_t vfs_find_entry(VFS **vfs, int32_t dir_inode, const char *name, int32_t *cluster, int32_t *slot) {
+    block_iter it;
+    int32_t block;
+
+    block_iter_init(vfs, &it, dir_inode);
+    while (block_iter_next(vfs, &it, &block)) {
+        uint8_t *data = cache_get_cluster(vfs, block);
+        if (!data) continue;
+
+        int32_t found = dirscan_find_name(data, name);
+        if (found == ID_ITEM_FREE) continue;
+
+        int32_t node_id;
+        memcpy(&node_id, data + found * DIR_ENTRY_SIZE, sizeof(int32_t));
+        if (cluster) *cluster = block;
+        if (slot) *slot = found;
+        return node_id;
+    }
+    return ID_ITEM_FREE;
+}
 
-        if (!load_directory_from_vfs(vfs, new_dir, sub->inode)) {
-            return false;
+/*
+ * Tells if a directory has no entries, from its raw clusters when it is not loaded
+ */
+bool vfs_directory_empty(VFS **vfs, int32_t dir_inode) {
+    directory *dir = (*vfs)->all_dirs[dir_inode];
+    if (dir) return dir->subdir == NULL && dir->file == NULL;
+
+    block_iter it;
+    int32_t block;
+    uint64_t used[DIR_SLOT_WORDS];
+
+    block_iter_init(vfs, &it, dir_inode);
+    while (block_iter_next(vfs, &it, &block)) {
+        uint8_t *data = cache_get_cluster(vfs, block);
+        if (!data) continue;
+
+        dirscan_used_mask(data, used);
+        for (int w = 0; w < DIR_SLOT_WORDS; w++) {
+            if (used[w]) return false;
         }
     }
     return true;
 }
 
+static void dir_lru_unlink(VFS **vfs, directory *dir) {
+    if (dir->lru_prev) dir->lru_prev->lru_next = dir->lru_next; else (*vfs)->dir_lru_head = dir->lru_next;
+    if (dir->lru_next) dir->lru_next->lru_prev = dir->lru_prev; else (*vfs)->dir_lru_tail = dir->lru_prev;
+    dir->lru_prev = dir->lru_next = NULL;
+}
 
+static void dir_lru_push_front(VFS **vfs, directory *dir) {
+    dir->lru_prev = NULL;
+    dir->lru_next = (*vfs)->dir_lru_head;
+    if ((*vfs)->dir_lru_head) (*vfs)->dir_lru_head->lru_prev = dir;
+    (*vfs)->dir_lru_head = dir;
+    if (!(*vfs)->dir_lru_tail) (*vfs)->dir_lru_tail = dir;
+}
 
-int32_t *get_data_blocks(VFS **vfs, int32_t nodeid, int *block_count, int *rest) {
-    inode *node = &(*vfs)->inodes[nodeid];
-    if (!node) return NULL;
+/*
+ * Makes a loaded directory reachable through all_dirs; dir->parent and dir->current must be set
+ */
+void vfs_register_directory(VFS **vfs, directory *dir) {
+    (*vfs)->all_dirs[dir->current->inode] = dir;
+    if (dir->parent == dir) return;     /* Root stays loaded */
 
-    int max_blocks = 5 + (CLUSTER_SIZE / 4) + (CLUSTER_SIZE / 4) * (CLUSTER_SIZE / 4);
-    int32_t *blocks = calloc(max_blocks, sizeof(int32_t));
-    if (!blocks) return NULL;
+    dir->parent->open_children++;
+    dir_lru_push_front(vfs, dir);
+    (*vfs)->loaded_dir_count++;
+}
 
-    int count = 0;
+/*
+ * Returns the directory of a subdir item of parent, loading it on first use.
+ * Returns NULL when the item is not a directory or it cannot be loaded.
+ */
+directory *vfs_open_directory(VFS **vfs, directory *parent, dir_item *item) {
+    if (!item || item->inode < 0 || item->inode >= (*vfs)->superblock->inode_count ||
+        !(*vfs)->inodes[item->inode].isDirectory) {
+        return NULL;
+    }
 
+    directory *dir = (*vfs)->all_dirs[item->inode];
+    if (dir) {
+        if (dir->parent != dir) {
+            dir_lru_unlink(vfs, dir);
+            dir_lru_push_front(vfs, dir);
+        }
+        return dir;
+    }
 
-    int32_t *directs[] = {
-        &node->direct1, &node->direct2, &node->direct3,
-        &node->direct4, &node->direct5
-    };
-    for (int i = 0; i < 5; i++) {
-        if (*directs[i] != ID_ITEM_FREE)
-            blocks[count++] = *directs[i];
+    dir = vfs_alloc_directory(vfs);
+    if (!dir) {
+        printf(MEMORY_ERROR_MSG);
+        return NULL;
     }
+    dir->parent = parent;
+    dir->current = item;
 
-    if (node->indirect1 != ID_ITEM_FREE) {
-        seek_data_cluster(vfs, node->indirect1);
-        for (int i = 0; i < CLUSTER_SIZE / 4; i++) {
-            int32_t ref = 0;
-            vfs_read_int32(vfs, &ref);
-            if (ref > 0) blocks[count++] = ref;
-            else break;
+    if (!load_directory_from_vfs(vfs, dir, item->inode)) {
+        free_directory_items(vfs, dir);
+        vfs_free_directory(vfs, dir);
+        return NULL;
+    }
+
+    vfs_register_directory(vfs, dir);
+    return dir;
+}
+
+/*
+ * Creates the empty directory name in dir. Returns it already loaded, or NULL
+ * after printing the reason.
+ */
+directory *vfs_make_directory(VFS **vfs, directory *dir, char *name) {
+    if (check_if_exists(dir, name)) {
+        printf(FILE_EXISTS_MSG);
+        return NULL;
+    }
+
+    int32_t free_inode = vfs_alloc_inode(vfs);
+    if (free_inode == -1) {
+        printf(NO_FREE_INODE);
+        return NULL;
+    }
+
+    /* No cluster yet, the first entry attaches one (see create_directory_in_file) */
+    inode *new_inode = &(*vfs)->inodes[free_inode];
+    memset(new_inode, 0, sizeof(inode));
+    new_inode->nodeid = free_inode;
+    new_inode->isDirectory = true;
+    new_inode->references = 1;
+    new_inode->file_size = 0;
+    new_inode->direct1 = new_inode->direct2 = new_inode->direct3 = new_inode->direct4 =
+    new_inode->direct5 = new_inode->indirect1 = new_inode->indirect2 = ID_ITEM_FREE;
+
+    dir_item *new_item = create_directory_item(vfs, free_inode, name);
+    if (!new_item) {
+        vfs_free_inode(vfs, free_inode);
+        printf(MEMORY_ERROR_MSG);
+        return NULL;
+    }
+
+    directory *new_dir = vfs_alloc_directory(vfs);
+    if (!new_dir) {
+        vfs_free_inode(vfs, free_inode);
+        free_directory_item(vfs, new_item);
+        printf(MEMORY_ERROR_MSG);
+        return NULL;
+    }
+
+
+    new_dir->current = new_item;
+    new_dir->parent = dir;
+    new_dir->subdir = NULL;
+    new_dir->file = NULL;
+
+    if (!directory_add_item(dir, new_item, true)) {
+        vfs_free_inode(vfs, free_inode);
+        vfs_free_directory(vfs, new_dir);
+        free_directory_item(vfs, new_item);
+        printf(MEMORY_ERROR_MSG);
+        return NULL;
+    }
+    vfs_register_directory(vfs, new_dir);  /* New and empty, so already loaded */
+    dcache_invalidate_item(vfs, dir, name);
+
+    if (update_directory_in_file(vfs, dir, new_item, true) == ERROR_CODE) {
+        printf("Error writing directory structure to VFS.\n");
+        return NULL;
+    }
+
+    write_inode_to_vfs(vfs, free_inode);
+    return new_dir;
+}
+
+directory *vfs_alloc_directory(VFS **vfs) {
+    return slab_alloc(&(*vfs)->dir_pool);
+}
+
+void vfs_free_directory(VFS **vfs, directory *dir) {
+    slab_free(&(*vfs)->dir_pool, dir);
+}
+
+/*
+ * Frees the items, the name index and the free entry map of a directory
+ */
+void free_directory_items(VFS **vfs, directory *dir) {
+    dir_item *lists[] = {dir->subdir, dir->file};
+    for (int i = 0; i < 2; i++) {
+        dir_item *item = lists[i];
+        while (item) {
+            dir_item *next = item->next;
+            free_directory_item(vfs, item);
+            item = next;
+        }
+    }
+    dir->subdir = dir->file = dir->subdir_tail = dir->file_tail = NULL;
+    dir_index_free(&dir->index);
+    dir_slots_free(&dir->slots);
+}
+
+/*
+ * Drops a loaded directory from memory. It must not have loaded subdirs; its own
+ * item stays in the parent, so it can be loaded again through vfs_open_directory().
+ */
+void vfs_close_directory(VFS **vfs, directory *dir) {
+    if (!dir || dir->parent == dir || dir->open_children > 0) return;
+
+    dcache_invalidate_item(vfs, dir->parent, dir->current->item_name);
+    (*vfs)->all_dirs[dir->current->inode] = NULL;
+    dir->parent->open_children--;
+    dir_lru_unlink(vfs, dir);
+    (*vfs)->loaded_dir_count--;
+
+    free_directory_items(vfs, dir);
+    vfs_free_directory(vfs, dir);
+}
+
+/*
+ * Drops the whole in-memory directory tree at once (on unmount and re-format).
+ * Only the per-directory tables are freed one by one, the nodes go with their slabs.
+ */
+void vfs_release_directories(VFS **vfs) {
+    if ((*vfs)->all_dirs && (*vfs)->superblock) {
+        for (int32_t i = 0; i < (*vfs)->superblock->inode_count; i++) {
+            directory *dir = (*vfs)->all_dirs[i];
+            if (!dir) continue;
+            dir_index_free(&dir->index);
+            dir_slots_free(&dir->slots);
         }
     }
+    free((*vfs)->all_dirs);
+    (*vfs)->all_dirs = NULL;
+    (*vfs)->current_dir = NULL;
+    (*vfs)->dir_lru_head = (*vfs)->dir_lru_tail = NULL;
+    (*vfs)->loaded_dir_count = 0;
+    dcache_reset((*vfs)->dcache);
+
+    slab_release(&(*vfs)->item_pool);
+    slab_release(&(*vfs)->dir_pool);
+}
 
-    if (node->indirect2 != ID_ITEM_FREE) {
-        seek_data_cluster(vfs, node->indirect2);
-        for (int i = 0; i < CLUSTER_SIZE / 4; i++) {
-            int32_t ref_block = 0;
-            vfs_read_int32(vfs, &ref_block);
-            if (ref_block > 0) {
-                seek_data_cluster(vfs, ref_block);
-                for (int j = 0; j < CLUSTER_SIZE / 4; j++) {
-                    int32_t ref = 0;
-                    vfs_read_int32(vfs, &ref);
-                    if (ref > 0) blocks[count++] = ref;
-                    else break;
-                }
+/*
+ * Evicts least recently used directories until at most LOADED_DIRS_LIMIT stay loaded.
+ * Runs between commands, so no directory pointer is held by a command. Directories
+ * with loaded subdirs and the current directory (with its ancestors) are kept.
+ */
+void vfs_trim_directories(VFS **vfs) {
+    bool evicted = true;
+    while ((*vfs)->loaded_dir_count > LOADED_DIRS_LIMIT && evicted) {
+        evicted = false;
+        directory *dir = (*vfs)->dir_lru_tail;
+        while (dir && (*vfs)->loaded_dir_count > LOADED_DIRS_LIMIT) {
+            directory *prev = dir->lru_prev;
+            if (dir->open_children == 0 && dir != (*vfs)->current_dir) {
+                vfs_close_directory(vfs, dir);
+                evicted = true;
             }
+            dir = prev;
         }
     }
+}
+
 
-    *block_count = count;
-    return blocks;
+
+long vfs_cluster_offset(VFS **vfs, int32_t cluster) {
+    return (*vfs)->superblock->data_start_address + (long)cluster * CLUSTER_SIZE;
 }
 
 int seek_data_cluster(VFS **vfs, int block_number) {
-    return seek_set(vfs, (*vfs)->superblock->data_start_address + block_number * CLUSTER_SIZE);
+    return seek_set(vfs, vfs_cluster_offset(vfs, block_number));
 }
 
 int seek_set(VFS **vfs, long int offset) {
+    if ((*vfs)->map) {
+        (*vfs)->map_pos = offset;
+        return 0;
+    }
     return fseek((*vfs)->vfs_file, offset, SEEK_SET);
 }
 
 int seek_cur(VFS **vfs, long int offset) {
+    if ((*vfs)->map) {
+        (*vfs)->map_pos += offset;
+        return 0;
+    }
     return fseek((*vfs)->vfs_file, offset, SEEK_CUR);
 }
 
+/*
+ * fread/fwrite equivalent for the memory-mapped image, moves the map cursor
+ */
+static size_t map_transfer(VFS **vfs, void *ptr, size_t size, size_t count, bool write) {
+    VFS *v = *vfs;
+    if (size == 0 || v->map_pos < 0 || (size_t)v->map_pos >= v->map_size) return 0;
+
+    size_t available = (v->map_size - v->map_pos) / size;
+    if (count > available) count = available;
+
+    if (write) memcpy(v->map + v->map_pos, ptr, size * count);
+    else memcpy(ptr, v->map + v->map_pos, size * count);
+
+    v->map_pos += size * count;
+    return count;
+}
 
 size_t write_vfs(VFS **vfs, const void * ptr, size_t size, size_t count) {
+    if ((*vfs)->map) return map_transfer(vfs, (void *)ptr, size, count, true);
     return fwrite(ptr, size, count, (*vfs)->vfs_file);
 }
 
 
+/*
+ * Schedules the inode for writing, the record is stored on the next vfs_commit()
+ */
 void write_inode_to_vfs(VFS **vfs, int id) {
-    vfs_seek_from_start(vfs, (*vfs)->superblock->inode_start_address + id * INODE_SIZE);
-
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].nodeid));
-    vfs_write_int8(vfs, &((*vfs)->inodes[id].isDirectory));
-    vfs_write_int8(vfs, &((*vfs)->inodes[id].references));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].file_size));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].direct1));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].direct2));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].direct3));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].direct4));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].direct5));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].indirect1));
-    vfs_write_int32(vfs, &((*vfs)->inodes[id].indirect2));
-
-    flush_vfs(vfs);
+    vfs_mark_inode_dirty(vfs, id);
 }
 
 size_t vfs_write_int32(VFS **vfs, const void *ptr) {
-    return fwrite(ptr, sizeof(int32_t), 1, (*vfs)->vfs_file);
+    return write_vfs(vfs, ptr, sizeof(int32_t), 1);
 }
 
 size_t vfs_write_int8(VFS **vfs, const void *ptr) {
-    return fwrite(ptr, sizeof(int8_t), 1, (*vfs)->vfs_file);
+    return write_vfs(vfs, ptr, sizeof(int8_t), 1);
 }
 
 /*
  * Read raw data from VFS file
  */
 size_t vfs_read(VFS **vfs, void *ptr, size_t size, size_t count) {
+    if ((*vfs)->map) return map_transfer(vfs, ptr, size, count, false);
     return fread(ptr, size, count, (*vfs)->vfs_file);
 }
 
@@ -340,28 +752,166 @@ size_t vfs_read(VFS **vfs, void *ptr, size_t size, size_t count) {
  * Read int8_t (1 byte)
  */
 size_t vfs_read_int8(VFS **vfs, void *ptr) {
-    return fread(ptr, sizeof(int8_t), 1, (*vfs)->vfs_file);
+    return vfs_read(vfs, ptr, sizeof(int8_t), 1);
 }
 
 /*
  * Read int32_t (4 bytes)
  */
 size_t vfs_read_int32(VFS **vfs, void *ptr) {
-    return fread(ptr, sizeof(int32_t), 1, (*vfs)->vfs_file);
+    return vfs_read(vfs, ptr, sizeof(int32_t), 1);
 }
 
 void rewind_vfs(VFS **vfs) {
+    if ((*vfs)->map) {
+        (*vfs)->map_pos = 0;
+        return;
+    }
     rewind((*vfs)->vfs_file);
 }
 
 void flush_vfs(VFS **vfs) {
     if (vfs && *vfs && (*vfs)->vfs_file) {
+        if ((*vfs)->map) {
+            /* Stores are already in the page cache, only schedule the write-out (like fflush) */
+            msync((*vfs)->map, (*vfs)->map_size, MS_ASYNC);
+            return;
+        }
+        cache_flush(vfs);
         fflush((*vfs)->vfs_file);
     }
 }
 
 int vfs_seek_from_start(VFS **vfs, long offset) {
-    return fseek((*vfs)->vfs_file, offset, SEEK_SET);
+    return seek_set(vfs, offset);
+}
+
+/*
+ * Positional writes used by the write-back paths. They bypass the stdio buffer, so one
+ * call is one syscall; anything still buffered in the stream is pushed out first.
+ */
+size_t vfs_pwrite(VFS **vfs, const void *ptr, size_t size, long offset) {
+    vfs_sync_stream(vfs);
+    return vfs_pwrite_direct(vfs, ptr, size, offset);
+}
+
+/*
+ * Same as vfs_pwrite() without touching the stdio stream, so it may run beside the
+ * thread that uses it (import workers). The caller calls vfs_sync_stream() before
+ * and after such writes.
+ */
+size_t vfs_pwrite_direct(VFS **vfs, const void *ptr, size_t size, long offset) {
+    if ((*vfs)->map) {
+        if (offset < 0 || (size_t)offset + size > (*vfs)->map_size) return 0;
+        memcpy((*vfs)->map + offset, ptr, size);
+        return size;
+    }
+
+    ssize_t written = pwrite(fileno((*vfs)->vfs_file), ptr, size, offset);
+    return written < 0 ? 0 : (size_t)written;
+}
+
+/*
+ * Pushes out buffered stdio writes and drops buffered reads, so the stream and
+ * positional writes see the same image
+ */
+void vfs_sync_stream(VFS **vfs) {
+    if (!(*vfs)->map) fflush((*vfs)->vfs_file);
+}
+
+size_t vfs_pwritev(VFS **vfs, const struct iovec *iov, int count, long offset) {
+    if ((*vfs)->map) {
+        size_t total = 0;
+        for (int i = 0; i < count; i++) {
+            total += vfs_pwrite(vfs, iov[i].iov_base, iov[i].iov_len, offset + (long)total);
+        }
+        return total;
+    }
+
+    fflush((*vfs)->vfs_file);
+    ssize_t written = pwritev(fileno((*vfs)->vfs_file), iov, count, offset);
+    return written < 0 ? 0 : (size_t)written;
+}
+
+/*
+ * Bytes the image needs to hold every data cluster described by the superblock
+ */
+size_t vfs_image_size(VFS **vfs) {
+    return (size_t)(*vfs)->superblock->data_start_address +
+           (size_t)(*vfs)->superblock->data_cluster_count * CLUSTER_SIZE;
+}
+
+/*
+ * Grows the image file to vfs_image_size() without writing it; the untouched
+ * part stays a hole, reads back as zeros and takes no disk blocks.
+ */
+bool vfs_reserve_image(VFS **vfs) {
+    fflush((*vfs)->vfs_file);
+    return ftruncate(fileno((*vfs)->vfs_file), (off_t)vfs_image_size(vfs)) == 0;
+}
+
+/*
+ * Maps the image file into memory. The file is grown first if the data area described
+ * by the superblock reaches past its end. Any previous mapping is replaced.
+ */
+bool vfs_map_image(VFS **vfs) {
+    int fd = fileno((*vfs)->vfs_file);
+    struct stat st;
+
+    fflush((*vfs)->vfs_file);
+    if (fstat(fd, &st) != 0) return false;
+
+    size_t size = (size_t)st.st_size;
+    if ((*vfs)->superblock && size < vfs_image_size(vfs)) {
+        if (!vfs_reserve_image(vfs)) return false;
+        size = vfs_image_size(vfs);
+    }
+    if (size == 0) return false;
+
+    vfs_unmap_image(vfs);
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return false;
+
+    (*vfs)->map = map;
+    (*vfs)->map_size = size;
+    (*vfs)->map_pos = 0;
+
+    /* The bitmap is used in place */
+    if ((*vfs)->superblock && (*vfs)->data_bitmap) {
+        uint64_t *mapped_bitmap = (uint64_t *)((*vfs)->map + (*vfs)->superblock->bitmap_start_address);
+        if (!(*vfs)->bitmap_mapped) free((*vfs)->data_bitmap);
+        (*vfs)->data_bitmap = mapped_bitmap;
+        (*vfs)->bitmap_mapped = true;
+    }
+    return true;
+}
+
+void vfs_unmap_image(VFS **vfs) {
+    if (!(*vfs)->map) return;
+
+    if ((*vfs)->bitmap_mapped) {
+        /* Keep a private copy, the pointer into the mapping is about to become invalid */
+        uint64_t *copy = malloc(bitmap_word_count(vfs) * sizeof(uint64_t));
+        if (copy) memcpy(copy, (*vfs)->data_bitmap, bitmap_word_count(vfs) * sizeof(uint64_t));
+        (*vfs)->data_bitmap = copy;
+        (*vfs)->bitmap_mapped = false;
+    }
+
+    msync((*vfs)->map, (*vfs)->map_size, MS_SYNC);
+    munmap((*vfs)->map, (*vfs)->map_size);
+    (*vfs)->map = NULL;
+    (*vfs)->map_size = 0;
+    (*vfs)->map_pos = 0;
+}
+
+/*
+ * Returns pointer to a data cluster inside the mapping
+ */
+uint8_t *vfs_cluster_ptr(VFS **vfs, int32_t cluster) {
+    size_t offset = (size_t)(*vfs)->superblock->data_start_address + (size_t)cluster * CLUSTER_SIZE;
+    if (!(*vfs)->map || offset + CLUSTER_SIZE > (*vfs)->map_size) return NULL;
+    return (*vfs)->map + offset;
 }
 
 void vfs_init_inodes(VFS **vfs) {
@@ -382,18 +932,20 @@ void vfs_init_inodes(VFS **vfs) {
 }
 
 void vfs_init_root_directory(VFS **vfs) {
-    directory *root = calloc(1, sizeof(directory));
-    dir_item *root_item = create_directory_item(0, "/");
+    directory *root = vfs_alloc_directory(vfs);
+    dir_item *root_item = create_directory_item(vfs, 0, "/");
 
     root->parent = root;
     root->current = root_item;
     root->subdir = NULL;
     root->file = NULL;
+    dir_slots_add_block(&root->slots, 0, NULL);
 
     (*vfs)->current_dir = root;
     (*vfs)->all_dirs[0] = root;
 
-    (*vfs)->data_bitmap[0] = 1;
+    bitmap_set(vfs, 0, true);
+    inode_bitmap_set(vfs, 0, true);
     inode *root_inode = &(*vfs)->inodes[0];
     root_inode->nodeid = 0;
     root_inode->isDirectory = 1;
@@ -408,11 +960,23 @@ bool vfs_init_memory_structures(VFS **vfs, int32_t vfs_size) {
     (*vfs)->superblock = superblock_init(vfs_size);
     if (!(*vfs)->superblock) return false;
 
-    (*vfs)->data_bitmap = calloc(1, (*vfs)->superblock->cluster_count);
+    free((*vfs)->inode_bitmap);
+    free((*vfs)->refcounts);
+    free((*vfs)->dedup_index);
+    free((*vfs)->dedup_slots);
+    (*vfs)->data_bitmap = calloc(bitmap_word_count(vfs), sizeof(uint64_t));
+    (*vfs)->inode_bitmap = calloc(inode_bitmap_word_count(vfs), sizeof(uint64_t));
+    /* A fresh region is all zeros, every cluster has its single owner */
+    (*vfs)->refcounts = calloc((size_t)(*vfs)->superblock->refcount_cluster_count * CLUSTER_SIZE, 1);
+    (*vfs)->dedup_index = calloc((size_t)(*vfs)->superblock->dedup_cluster_count * CLUSTER_SIZE, 1);
+    (*vfs)->dedup_slots = calloc((*vfs)->superblock->cluster_count, sizeof(int32_t));
     (*vfs)->inodes = calloc((*vfs)->superblock->inode_count, sizeof(inode));
     (*vfs)->all_dirs = calloc((*vfs)->superblock->inode_count, sizeof(directory *));
+    (*vfs)->dir_lru_head = (*vfs)->dir_lru_tail = NULL;
+    (*vfs)->loaded_dir_count = 0;
 
-    if (!(*vfs)->data_bitmap || !(*vfs)->inodes || !(*vfs)->all_dirs)
+    if (!(*vfs)->data_bitmap || !(*vfs)->inode_bitmap || !(*vfs)->refcounts || !(*vfs)->dedup_index ||
+        !(*vfs)->dedup_slots || !(*vfs)->inodes || !(*vfs)->all_dirs || !vfs_init_dirty_sets(vfs))
         return false;
 
     vfs_init_inodes(vfs);
@@ -434,28 +998,212 @@ void vfs_write_superblock_to_file(VFS **vfs) {
     vfs_write_int32(vfs, &(*vfs)->superblock->bitmap_start_address);
     vfs_write_int32(vfs, &(*vfs)->superblock->inode_start_address);
     vfs_write_int32(vfs, &(*vfs)->superblock->data_start_address);
+    vfs_write_int32(vfs, &(*vfs)->superblock->features);
+    vfs_write_int32(vfs, &(*vfs)->superblock->free_hint);
+    vfs_write_int32(vfs, &(*vfs)->superblock->inode_bitmap_cluster_count);
+    vfs_write_int32(vfs, &(*vfs)->superblock->inode_bitmap_start_address);
+    vfs_write_int32(vfs, &(*vfs)->superblock->free_inode_count);
+    vfs_write_int32(vfs, &(*vfs)->superblock->inode_hint);
+    vfs_write_int32(vfs, &(*vfs)->superblock->refcount_cluster_count);
+    vfs_write_int32(vfs, &(*vfs)->superblock->refcount_start_address);
+    vfs_write_int32(vfs, &(*vfs)->superblock->dedup_cluster_count);
+    vfs_write_int32(vfs, &(*vfs)->superblock->dedup_start_address);
+}
+
+/*
+ * Rewrites the superblock in place with a single write
+ */
+void vfs_store_superblock(VFS **vfs) {
+    vfs_pwrite(vfs, (*vfs)->superblock, sizeof(superblock), 0);
+    (*vfs)->superblock_dirty = false;
 }
 
 void vfs_write_bitmaps_to_file(VFS **vfs) {
     vfs_seek_from_start(vfs, (*vfs)->superblock->bitmap_start_address);
-    fwrite((*vfs)->data_bitmap, sizeof(int8_t), (*vfs)->superblock->cluster_count, (*vfs)->vfs_file);
+    write_vfs(vfs, (*vfs)->data_bitmap, sizeof(uint64_t), bitmap_word_count(vfs));
+    memset((*vfs)->dirty_bitmap_pages, 0, (*vfs)->superblock->bitmap_cluster_count * sizeof(bool));
+
+    if ((*vfs)->superblock->inode_bitmap_cluster_count > 0) {
+        vfs_seek_from_start(vfs, (*vfs)->superblock->inode_bitmap_start_address);
+        write_vfs(vfs, (*vfs)->inode_bitmap, sizeof(uint64_t), inode_bitmap_word_count(vfs));
+        memset((*vfs)->dirty_inode_bitmap_pages, 0, (*vfs)->superblock->inode_bitmap_cluster_count * sizeof(bool));
+    }
 }
 
-void vfs_write_inodes_to_file(VFS **vfs) {
-    vfs_seek_from_start(vfs, (*vfs)->superblock->inode_start_address);
-    for (int i = 0; i < (*vfs)->superblock->inode_count; i++) {
-        write_inode_to_vfs(vfs, i);
+/*
+ * Writes inode records [first, first + count), encoding INODE_IO_BATCH at a time
+ */
+static void write_inode_range(VFS **vfs, int32_t first, int32_t count) {
+    if ((*vfs)->map) {
+        inode_disk *table = (inode_disk *)((*vfs)->map + (*vfs)->superblock->inode_start_address);
+        for (int32_t i = first; i < first + count; i++) inode_encode(&(*vfs)->inodes[i], &table[i]);
+        return;
     }
+
+    inode_disk page[INODES_PER_CLUSTER];
+    int32_t batch_size = count < INODE_IO_BATCH ? count : INODE_IO_BATCH;
+    inode_disk *batch = batch_size > INODES_PER_CLUSTER ? malloc(batch_size * sizeof(inode_disk)) : NULL;
+    if (!batch) {
+        batch = page;
+        batch_size = INODES_PER_CLUSTER;
+    }
+
+    long offset = (*vfs)->superblock->inode_start_address + (long)first * INODE_SIZE;
+    for (int32_t done = 0; done < count; ) {
+        int32_t n = count - done < batch_size ? count - done : batch_size;
+        for (int32_t i = 0; i < n; i++) inode_encode(&(*vfs)->inodes[first + done + i], &batch[i]);
+        vfs_pwrite(vfs, batch, n * sizeof(inode_disk), offset + (long)done * INODE_SIZE);
+        done += n;
+    }
+
+    if (batch != page) free(batch);
+}
+
+/*
+ * Number of INODES_PER_CLUSTER pages of the inode table, the unit of the dirty set
+ */
+static int32_t inode_page_count(VFS **vfs) {
+    return ((*vfs)->superblock->inode_count + INODES_PER_CLUSTER - 1) / INODES_PER_CLUSTER;
+}
+
+/*
+ * Stores the whole inode table with sequential writes of INODE_IO_BATCH records
+ */
+void vfs_write_inodes_to_file(VFS **vfs) {
+    int32_t count = (*vfs)->superblock->inode_count;
+    write_inode_range(vfs, 0, count);
+    memset((*vfs)->dirty_inode_pages, 0, inode_page_count(vfs) * sizeof(bool));
+    flush_vfs(vfs);
 }
 
-int32_t vfs_find_free_inode(VFS **vfs) {
-    for (int i = 0; i < (*vfs)->superblock->inode_count; i++) {
-        if ((*vfs)->inodes[i].nodeid == ID_ITEM_FREE) {
-            return i;
+/*
+ * Rebuilds the inode bitmap from the loaded inode table and checks it against the
+ * stored one; a stored bitmap that differs is rewritten on the next commit
+ */
+bool vfs_load_inode_bitmap(VFS **vfs) {
+    superblock *sb = (*vfs)->superblock;
+    int32_t words = inode_bitmap_word_count(vfs);
+
+    free((*vfs)->inode_bitmap);
+    (*vfs)->inode_bitmap = calloc(words, sizeof(uint64_t));
+    if (!(*vfs)->inode_bitmap) return false;
+
+    int32_t free_count = 0;
+    for (int32_t i = 0; i < sb->inode_count; i++) {
+        if ((*vfs)->inodes[i].nodeid == ID_ITEM_FREE) free_count++;
+        else (*vfs)->inode_bitmap[i / BITMAP_WORD_BITS] |= 1ULL << (i % BITMAP_WORD_BITS);
+    }
+
+    if (sb->inode_bitmap_cluster_count > 0) {
+        uint64_t *stored = malloc(words * sizeof(uint64_t));
+        if (!stored) return false;
+        vfs_seek_from_start(vfs, sb->inode_bitmap_start_address);
+        if (vfs_read(vfs, stored, sizeof(uint64_t), words) != (size_t)words ||
+            memcmp(stored, (*vfs)->inode_bitmap, words * sizeof(uint64_t)) != 0) {
+            printf(INODE_BITMAP_REPAIR_MSG);
+            for (int32_t page = 0; page < sb->inode_bitmap_cluster_count; page++) {
+                vfs_mark_inode_bitmap_dirty(vfs, page * CLUSTER_SIZE * 8);
+            }
         }
+        free(stored);
     }
 
-    return ID_ITEM_FREE;
+    if (sb->free_inode_count != free_count) {
+        sb->free_inode_count = free_count;
+        (*vfs)->superblock_dirty = true;
+    }
+    if (sb->inode_hint < 1 || sb->inode_hint >= sb->inode_count) {
+        sb->inode_hint = 1;
+    }
+    return true;
+}
+
+/*
+ * Reads the cluster reference counts; images without the region get none and
+ * never share clusters
+ */
+bool vfs_load_refcounts(VFS **vfs) {
+    superblock *sb = (*vfs)->superblock;
+
+    free((*vfs)->refcounts);
+    (*vfs)->refcounts = NULL;
+    if (sb->refcount_cluster_count == 0) return true;
+
+    size_t bytes = (size_t)sb->refcount_cluster_count * CLUSTER_SIZE;
+    (*vfs)->refcounts = calloc(bytes, 1);
+    if (!(*vfs)->refcounts) return false;
+
+    vfs_seek_from_start(vfs, sb->refcount_start_address);
+    vfs_read(vfs, (*vfs)->refcounts, 1, bytes);
+    return true;
+}
+
+int32_t dedup_bucket_count(VFS **vfs) {
+    return (int32_t)((int64_t)(*vfs)->superblock->dedup_cluster_count * CLUSTER_SIZE / (int)sizeof(dedup_entry));
+}
+
+/*
+ * Reads the deduplication index and notes the bucket of every indexed cluster;
+ * images without the region get none and never deduplicate
+ */
+bool vfs_load_dedup_index(VFS **vfs) {
+    superblock *sb = (*vfs)->superblock;
+
+    free((*vfs)->dedup_index);
+    free((*vfs)->dedup_slots);
+    (*vfs)->dedup_index = NULL;
+    (*vfs)->dedup_slots = NULL;
+    if (sb->dedup_cluster_count == 0) return true;
+
+    size_t bytes = (size_t)sb->dedup_cluster_count * CLUSTER_SIZE;
+    (*vfs)->dedup_index = calloc(bytes, 1);
+    (*vfs)->dedup_slots = calloc(sb->cluster_count, sizeof(int32_t));
+    if (!(*vfs)->dedup_index || !(*vfs)->dedup_slots) return false;
+
+    vfs_seek_from_start(vfs, sb->dedup_start_address);
+    vfs_read(vfs, (*vfs)->dedup_index, 1, bytes);
+
+    int32_t buckets = dedup_bucket_count(vfs);
+    for (int32_t i = 0; i < buckets; i++) {
+        int32_t cluster = (*vfs)->dedup_index[i].cluster;
+        if (cluster > 0 && cluster < sb->cluster_count) (*vfs)->dedup_slots[cluster] = i + 1;
+    }
+    return true;
+}
+
+/*
+ * Takes a free inode, searching from the rotating hint. The inode is marked used,
+ * its record is filled in by the caller. Returns ID_ITEM_FREE when none is left.
+ */
+int32_t vfs_alloc_inode(VFS **vfs) {
+    superblock *sb = (*vfs)->superblock;
+    if (sb->free_inode_count <= 0) return ID_ITEM_FREE;
+
+    int32_t hint = sb->inode_hint;
+    int32_t id = bitmap_next_free((*vfs)->inode_bitmap, hint, sb->inode_count);
+    if (id == ID_ITEM_FREE) id = bitmap_next_free((*vfs)->inode_bitmap, 1, hint);
+    if (id == ID_ITEM_FREE) return ID_ITEM_FREE;
+
+    inode_bitmap_set(vfs, id, true);
+    sb->inode_hint = id + 1 < sb->inode_count ? id + 1 : 1;
+    return id;
+}
+
+/*
+ * Returns an inode to the free pool and schedules its cleared record for writing
+ */
+void vfs_free_inode(VFS **vfs, int32_t id) {
+    inode *node = &(*vfs)->inodes[id];
+    node->nodeid = ID_ITEM_FREE;
+    node->isDirectory = 0;
+    node->references = 0;
+    node->file_size = 0;
+    node->direct1 = node->direct2 = node->direct3 = node->direct4 = node->direct5 = ID_ITEM_FREE;
+    node->indirect1 = node->indirect2 = ID_ITEM_FREE;
+    node->flags = 0;
+
+    inode_bitmap_set(vfs, id, false);
+    write_inode_to_vfs(vfs, id);
 }
 
 int update_directory_in_file(VFS** vfs, directory *dir, dir_item *item, bool create) {
@@ -470,211 +1218,524 @@ int update_directory_in_file(VFS** vfs, directory *dir, dir_item *item, bool cre
 }
 
 
-int create_directory_in_file(VFS** vfs, directory *dir, dir_item *item) {
-    int i, j, block_count;
-    int32_t *blocks, *free_block;
-    int max_items_in_block = 64;
-    int32_t nodeid;
-    inode *dir_node;
-
-    /* Get data blocks */
-    blocks = get_data_blocks(vfs, dir->current->inode, &block_count, NULL);
-
-    for (i = 0; i < block_count; i++) {
-        seek_data_cluster(vfs, blocks[i]);
-        for (j = 0; j < max_items_in_block; j++) {
-            vfs_read_int32(vfs, &nodeid);
-            if (nodeid == 0) {
-                seek_cur(vfs, -4); /* Rewind back for a size of int32_t (4 bytes) */
-                vfs_write_int32(vfs, &(item->inode)); /* Store address of inode */
-                write_vfs(vfs, item->item_name, sizeof(item->item_name), 1); /* Store name of folder */
-                flush_vfs(vfs);
-                free(blocks);
-                return NO_ERROR_CODE;
-            } else {
-                seek_cur(vfs, MAX_ITEM_NAME_LENGTH);	/* Skip filename */
+/*
+ * Number of references before the first empty address of a packed list
+ */
+static int32_t packed_length(const int32_t *refs) {
+    int32_t count = 0;
+    while (count < INT32_COUNT_IN_BLOCK && refs[count] > 0) count++;
+    return count;
+}
+
+/*
+ * Attaches a fresh zeroed cluster to the map of directory nodeid: in a free direct
+ * slot, at the end of the packed list of indirect1, or at the end of a list of
+ * indirect2, creating the indirect clusters that are missing. Directory maps may
+ * have holes left by released clusters, so the position is searched, not appended.
+ * Returns the cluster, or ID_ITEM_FREE when the map is full or the volume is.
+ */
+static int32_t attach_directory_block(VFS **vfs, int32_t nodeid) {
+    inode *node = &(*vfs)->inodes[nodeid];
+    int32_t *directs[] = {&node->direct1, &node->direct2, &node->direct3, &node->direct4, &node->direct5};
+    int32_t refs[INT32_COUNT_IN_BLOCK], outer[INT32_COUNT_IN_BLOCK];
+    int32_t pos = ID_ITEM_FREE, outer_slot = ID_ITEM_FREE, meta_count = 0;
+    int i;
+
+    for (i = 0; i < DIRECT_BLOCK_COUNT && pos < 0; i++) {
+        if (*directs[i] == ID_ITEM_FREE) pos = i;
+    }
+
+    if (pos < 0 && node->indirect1 == ID_ITEM_FREE) {
+        pos = DIRECT_BLOCK_COUNT;
+        meta_count = 1;
+    } else if (pos < 0) {
+        if (!cache_read(vfs, node->indirect1, 0, refs, CLUSTER_SIZE)) return ID_ITEM_FREE;
+        int32_t used = packed_length(refs);
+        if (used < INT32_COUNT_IN_BLOCK) pos = DIRECT_BLOCK_COUNT + used;
+    }
+
+    if (pos < 0 && node->indirect2 == ID_ITEM_FREE) {
+        outer_slot = 0;
+        meta_count = 2;
+    } else if (pos < 0) {
+        if (!cache_read(vfs, node->indirect2, 0, outer, CLUSTER_SIZE)) return ID_ITEM_FREE;
+        for (i = 0; i < INT32_COUNT_IN_BLOCK && pos < 0; i++) {
+            if (outer[i] <= 0) {
+                if (outer_slot < 0) outer_slot = i;
+                continue;
             }
+            if (!cache_read(vfs, outer[i], 0, refs, CLUSTER_SIZE)) return ID_ITEM_FREE;
+            int32_t used = packed_length(refs);
+            if (used < INT32_COUNT_IN_BLOCK) pos = DIRECT_BLOCK_COUNT + INT32_COUNT_IN_BLOCK + i * INT32_COUNT_IN_BLOCK + used;
         }
+        if (pos < 0 && outer_slot >= 0) meta_count = 1;
     }
 
-    /* No free space left, we need to assign new data cluster */
-    free_block = find_free_data_blocks(vfs, 1);
-    if (!free_block) {
-        return ERROR_CODE;
-    }
+    if (pos < 0 && outer_slot < 0) return ID_ITEM_FREE;     /* Every list of indirect2 is full */
+    if (pos < 0) pos = DIRECT_BLOCK_COUNT + INT32_COUNT_IN_BLOCK + outer_slot * INT32_COUNT_IN_BLOCK;
 
+    /* blocks[0] is the new directory cluster, the rest the indirect clusters it needs */
+    int32_t *blocks = find_free_data_blocks(vfs, 1 + meta_count);
+    if (!blocks) return ID_ITEM_FREE;
+    for (i = 0; i <= meta_count; i++) {
+        bitmap_set(vfs, blocks[i], true);
+        cache_zero_cluster(vfs, blocks[i]);     /* Fresh cluster, may still hold data of a removed item */
+    }
 
-    dir_node = &((*vfs)->inodes[dir->current->inode]);
+    if (meta_count == 1 && outer_slot < 0) {
+        node->indirect1 = blocks[1];
+    } else if (meta_count == 2) {
+        node->indirect2 = blocks[1];
+        cache_write(vfs, blocks[1], 0, &blocks[2], sizeof(int32_t));
+    } else if (meta_count == 1) {
+        cache_write(vfs, node->indirect2, outer_slot * (int)sizeof(int32_t), &blocks[1], sizeof(int32_t));
+    }
 
-    if (dir_node->direct1 == ID_ITEM_FREE) dir_node->direct1 = free_block[0];
-    else if (dir_node->direct2 == ID_ITEM_FREE) dir_node->direct2 = free_block[0];
-    else if (dir_node->direct3 == ID_ITEM_FREE) dir_node->direct3 = free_block[0];
-    else if (dir_node->direct4 == ID_ITEM_FREE) dir_node->direct4 = free_block[0];
-    else if (dir_node->direct5 == ID_ITEM_FREE) dir_node->direct5 = free_block[0];
-    else {
-        free(free_block);
-        free_block = find_free_data_blocks(vfs, 2);	/* Use indirect reference (need 2 free blocks - one to store addresses in indirect reference and one for the dirs) */
-        if (free_block == NULL) return ERROR_CODE;
+    int32_t block = blocks[0];
+    if (!blockmap_set(vfs, nodeid, pos, block)) {
+        for (i = 0; i <= meta_count; i++) bitmap_set(vfs, blocks[i], false);
+        block = ID_ITEM_FREE;
+    }
+    free(blocks);
+    return block;
+}
 
-        if (dir_node->indirect1 == ID_ITEM_FREE) {
-            dir_node->indirect1 = free_block[1];
+/*
+ * Stores the entry of item in a free entry of dir, taken from its free entry map.
+ * Only when every cluster is full a new one is attached to the directory inode.
+ */
+int create_directory_in_file(VFS** vfs, directory *dir, dir_item *item) {
+    int32_t block, slot;
+    uint8_t *cluster;
+
+    if (!dir_slots_take(&dir->slots, &block, &slot)) {
+        /* No free space left, we need to assign new data cluster */
+        block = attach_directory_block(vfs, dir->current->inode);
+        if (block == ID_ITEM_FREE) {
+            return ERROR_CODE;
         }
-        else if (dir_node->indirect2 == ID_ITEM_FREE) {
-            dir_node->indirect2 = free_block[1];
+
+        if (!dir_slots_add_block(&dir->slots, block, NULL)) {
+            printf(MEMORY_ERROR_MSG);
+            return ERROR_CODE;
         }
+        dir_slots_take(&dir->slots, &block, &slot);
+    }
 
-        seek_data_cluster(vfs, free_block[1]);
-        vfs_write_int32(vfs, &(free_block[0]));
+    cluster = cache_get_cluster(vfs, block);
+    if (!cluster) {
+        dir_slots_release(&dir->slots, block, slot);
+        return ERROR_CODE;
     }
 
-    seek_data_cluster(vfs, free_block[0]);
-    vfs_write_int32(vfs, &(item->inode));
-    write_vfs(vfs, item->item_name, sizeof(item->item_name), 1);
+    uint8_t *entry = cluster + slot * DIR_ENTRY_SIZE;
+    memcpy(entry, &(item->inode), sizeof(int32_t)); /* Store address of inode */
+    memcpy(entry + sizeof(int32_t), item->item_name, sizeof(item->item_name)); /* Store name of folder */
+    cache_mark_dirty(vfs, block);
 
-    flush_vfs(vfs);
-    update_bitmap_in_file(vfs, dir->current, 1, NULL, 0);
-    write_inode_to_vfs(vfs, dir->current->inode);
-    free(free_block);
-    free(blocks);
+    item->cluster = block;
+    item->slot = slot;
     return NO_ERROR_CODE;
 }
 
-int remove_directory_from_file(VFS** vfs, directory *dir, dir_item *item) {
-    int block_number, j, block_count, item_count, rest, found = 0;
-    int32_t *blocks, number, count, zero = 0;
-    int empty[4];
-    int max_items_in_block = 64;
-    int32_t nodeid;
 
-    memset(empty, 0, sizeof(empty));
+/*
+ * Removes ref from a cluster of int32 references. Packed clusters (indirect1 and the
+ * second level of indirect2) are terminated by the first empty address, so the last
+ * reference is moved into the hole. Returns the number of references left or -1.
+ */
+static int remove_cluster_reference(VFS **vfs, int32_t cluster, int32_t ref, bool packed) {
+    int32_t *refs = (int32_t *) cache_get_cluster(vfs, cluster);
+    if (!refs) return -1;
+
+    int count = 0, pos = -1, last = -1;
+    for (int i = 0; i < INT32_COUNT_IN_BLOCK; i++) {
+        if (refs[i] <= 0) {
+            if (packed) break;
+            continue;
+        }
+        if (refs[i] == ref && pos < 0) pos = i;
+        last = i;
+        count++;
+    }
+    if (pos < 0) return -1;
 
-    /* Get data blocks */
-    blocks = get_data_blocks(vfs, dir->current->inode, &block_count, &rest);
+    if (packed) {
+        refs[pos] = refs[last];
+        refs[last] = EMPTY_ADDRESS;
+    } else {
+        refs[pos] = EMPTY_ADDRESS;
+    }
+    cache_mark_dirty(vfs, cluster);
+    return count - 1;
+}
 
-    for (block_number = 0; block_number < block_count; block_number++) {
-        seek_data_cluster(vfs, blocks[block_number]);
+/*
+ * Detaches an emptied data block from the directory inode and frees it in the bitmap
+ */
+static void release_directory_block(VFS **vfs, inode *node, int32_t block) {
+    int32_t *directs[] = {&node->direct2, &node->direct3, &node->direct4, &node->direct5};
+    for (int i = 0; i < 4; i++) {
+        if (*directs[i] == block) {
+            *directs[i] = ID_ITEM_FREE;
+            bitmap_set(vfs, block, false);
+            return;
+        }
+    }
 
-        item_count = 0;	// Counter of items in this data block
-        for (j = 0; j < max_items_in_block; j++) {
-            vfs_read_int32(vfs, &nodeid);
-            if (nodeid > 0) {
-                item_count++;
+    if (node->indirect1 != ID_ITEM_FREE) {
+        int left = remove_cluster_reference(vfs, node->indirect1, block, true);
+        if (left >= 0) {
+            bitmap_set(vfs, block, false);
+            if (left == 0) {    /* Remove indirect reference if it is empty */
+                bitmap_set(vfs, node->indirect1, false);
+                node->indirect1 = ID_ITEM_FREE;
             }
+            return;
+        }
+    }
 
-            if (!found) {
-                if (nodeid == (item->inode)) {
-                    seek_cur(vfs, -4);
-                    write_vfs(vfs, &empty, sizeof(empty), 1);
-                    flush_vfs(vfs);
-                    found = 1;
-
-                    if (item_count > 1) break;
+    if (node->indirect2 != ID_ITEM_FREE) {
+        for (int i = 0; i < INT32_COUNT_IN_BLOCK; i++) {
+            /* Looked up each round, the lookups of the list below may evict it */
+            int32_t *outer = (int32_t *) cache_get_cluster(vfs, node->indirect2);
+            if (!outer) return;
+            int32_t inner = outer[i];
+            if (inner <= 0) continue;
+
+            int left = remove_cluster_reference(vfs, inner, block, true);
+            if (left < 0) continue;
+
+            bitmap_set(vfs, block, false);
+            if (left == 0) {
+                bitmap_set(vfs, inner, false);
+                if (remove_cluster_reference(vfs, node->indirect2, inner, false) == 0) {
+                    bitmap_set(vfs, node->indirect2, false);
+                    node->indirect2 = ID_ITEM_FREE;
                 }
             }
+            return;
         }
+    }
+}
 
-        if (found) {	/* Verify if data block is free - If yes remove reference to it */
-            if (item_count == 1) {
-                inode *node = &((*vfs)->inodes[item->inode]);
-
-                if (node->direct1 != block_number) {	/* Don't remove first direct */
-                    if (node->direct2 == block_number) {
-                        node->direct2 = ID_ITEM_FREE;
-                    }
-                    else if (node->direct3 == block_number) {
-                        node->direct3 = ID_ITEM_FREE;
-                    }
-                    else if (node->direct4 == block_number) {
-                        node->direct4 = ID_ITEM_FREE;
-                    }
-                    else if (node->direct5 == block_number) {
-                        node->direct5 = ID_ITEM_FREE;
-                    }
-                    else {
-                        for (int i = 0; i < 2; i++) {
-                            if (i == 0)	// Go through indirect1
-                                seek_data_cluster(vfs, node->indirect1);
-                            else 		// Go through indirect2
-                                seek_data_cluster(vfs, node->indirect2);
-
-                            count = 0;
-                            found = 0;
-                            for (j = 0; j < INT32_COUNT_IN_BLOCK; j++) {
-                                vfs_read_int32(vfs, &number);
-                                if (number > 0)
-                                    count++;
-                                if (!found) {
-                                    if (number == block_number) {
-                                        found = 1;
-                                        seek_cur(vfs, NEGATIVE_SIZE_OF_INT32);
-                                        vfs_write_int32(vfs, &zero);
-                                        flush_vfs(vfs);
-                                        if (count > 1)
-                                            break;
-                                    }
-                                }
-                            }
-
-                            if (found) {
-                                /* Remove indirect references if they are empty */
-                                if (count == 1) {
-                                    if (i == 0) {
-                                        node->indirect1 = ID_ITEM_FREE;
-                                    }
-                                    else {
-                                        node->indirect2 = ID_ITEM_FREE;
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                    }
-
-                    update_bitmap_in_file(vfs, item, 0, NULL, 0);
-                    write_inode_to_vfs(vfs, item->inode);
-                }
-            }
+/*
+ * Clears the entry of item at the position recorded when it was stored or loaded
+ */
+int remove_directory_from_file(VFS** vfs, directory *dir, dir_item *item) {
+    inode *dir_node = &((*vfs)->inodes[dir->current->inode]);
+    int32_t block = item->cluster;
 
-            free(blocks);
-            return NO_ERROR_CODE;
-        }
+    /* Position not recorded, find the entry in the clusters */
+    if (block == ID_ITEM_FREE &&
+        vfs_find_entry(vfs, dir->current->inode, item->item_name, &block, &item->slot) != item->inode) {
+        return ERROR_CODE;
     }
 
-    return ERROR_CODE;
+    int32_t left = dir_slots_release(&dir->slots, block, item->slot);
+    if (left < 0) return ERROR_CODE;
+
+    uint8_t *cluster = cache_get_cluster(vfs, block);
+    if (!cluster) return ERROR_CODE;
+
+    memset(cluster + item->slot * DIR_ENTRY_SIZE, 0, DIR_ENTRY_SIZE);
+    cache_mark_dirty(vfs, block);
+    item->cluster = ID_ITEM_FREE;
+
+    /* Verify if data block is free - if yes remove reference to it (don't remove first direct) */
+    if (left == 0 && block != dir_node->direct1) {
+        release_directory_block(vfs, dir_node, block);
+        dir_slots_drop_block(&dir->slots, block);
+        write_inode_to_vfs(vfs, dir->current->inode);
+    }
+
+    return NO_ERROR_CODE;
 }
 
 void update_bitmap_in_file(VFS** vfs, dir_item *item, int8_t value, int32_t *data_blocks, int b_count) {
-    int i, block_count;
-    int32_t *blocks;
+    int i;
 
+    if ((*vfs)->inodes[item->inode].flags & INODE_FLAG_INLINE) return;
+
+    /* Mark all blocks, they are written out on the next commit */
     if (!data_blocks) {
-        blocks = get_data_blocks(vfs, item->inode, &block_count, NULL);
+        block_iter it;
+        int32_t block;
+        block_iter_init(vfs, &it, item->inode);
+        while (block_iter_next(vfs, &it, &block)) {
+            bitmap_set(vfs, block, value);
+        }
     }
     else {
-        blocks = data_blocks;
-        block_count = b_count;
-    }
-
-    /* Write all blocks */
-    for (i = 0; i < block_count; i++) {
-        (*vfs)->data_bitmap[blocks[i]] = value;
-        seek_set(vfs, (*vfs)->superblock->bitmap_start_address + blocks[i]);
-        vfs_write_int8(vfs, &value);
+        for (i = 0; i < b_count; i++) {
+            bitmap_set(vfs, data_blocks[i], value);
+        }
     }
 
 
     /* Indirect 1 data block */
     if ((*vfs)->inodes[item->inode].indirect1 != ID_ITEM_FREE) {
-        (*vfs)->data_bitmap[(*vfs)->inodes[item->inode].indirect1] = value;
-        seek_set(vfs, (*vfs)->superblock->bitmap_start_address + (*vfs)->inodes[item->inode].indirect1);
-        vfs_write_int8(vfs, &value);
+        bitmap_set(vfs, (*vfs)->inodes[item->inode].indirect1, value);
     }
-    /* Indirect 2 data block */
+    /* Indirect 2 data block and its lists */
     if ((*vfs)->inodes[item->inode].indirect2 != ID_ITEM_FREE) {
-        (*vfs)->data_bitmap[(*vfs)->inodes[item->inode].indirect2] = value;
-        seek_set(vfs, (*vfs)->superblock->bitmap_start_address + (*vfs)->inodes[item->inode].indirect2);
-        vfs_write_int8(vfs, &value);
+        int32_t *outer = (int32_t *) cache_get_cluster(vfs, (*vfs)->inodes[item->inode].indirect2);
+        for (i = 0; outer && i < INT32_COUNT_IN_BLOCK; i++) {
+            if (outer[i] > 0) bitmap_set(vfs, outer[i], value);
+        }
+        bitmap_set(vfs, (*vfs)->inodes[item->inode].indirect2, value);
+    }
+}
+
+/*
+ * Allocates the dirty page sets for the inode table and the bitmap
+ */
+bool vfs_init_dirty_sets(VFS **vfs) {
+    free((*vfs)->dirty_inode_pages);
+    free((*vfs)->dirty_bitmap_pages);
+    /* By inode count, images from before INODE_SIZE records may hold more than inode_cluster_count pages */
+    (*vfs)->dirty_inode_pages = calloc(inode_page_count(vfs) + 1, sizeof(bool));
+    (*vfs)->dirty_bitmap_pages = calloc((*vfs)->superblock->bitmap_cluster_count, sizeof(bool));
+    free((*vfs)->dirty_inode_bitmap_pages);
+    free((*vfs)->dirty_refcount_pages);
+    free((*vfs)->dirty_dedup_pages);
+    /* At least one entry, images without the inode bitmap, refcount or dedup region have no pages */
+    (*vfs)->dirty_inode_bitmap_pages = calloc((*vfs)->superblock->inode_bitmap_cluster_count + 1, sizeof(bool));
+    (*vfs)->dirty_refcount_pages = calloc((*vfs)->superblock->refcount_cluster_count + 1, sizeof(bool));
+    (*vfs)->dirty_dedup_pages = calloc((*vfs)->superblock->dedup_cluster_count + 1, sizeof(bool));
+    (*vfs)->dirty_page_count = 0;
+    return (*vfs)->dirty_inode_pages && (*vfs)->dirty_bitmap_pages && (*vfs)->dirty_inode_bitmap_pages &&
+           (*vfs)->dirty_refcount_pages && (*vfs)->dirty_dedup_pages;
+}
+
+void vfs_mark_inode_dirty(VFS **vfs, int32_t id) {
+    blockmap_invalidate(vfs, id);
+
+    int32_t page = id / INODES_PER_CLUSTER;
+    if (id < 0 || page >= inode_page_count(vfs)) return;
+    if (!(*vfs)->dirty_inode_pages[page]) {
+        (*vfs)->dirty_inode_pages[page] = true;
+        (*vfs)->dirty_page_count++;
+    }
+}
+
+void vfs_mark_bitmap_dirty(VFS **vfs, int32_t block) {
+    if ((*vfs)->bitmap_mapped) return;  /* Already changed in place */
+
+    int32_t page = block / 8 / CLUSTER_SIZE;
+    if (!(*vfs)->dirty_bitmap_pages[page]) {
+        (*vfs)->dirty_bitmap_pages[page] = true;
+        (*vfs)->dirty_page_count++;
+    }
+}
+
+void vfs_mark_inode_bitmap_dirty(VFS **vfs, int32_t id) {
+    if ((*vfs)->superblock->inode_bitmap_cluster_count == 0) return;  /* Not stored in the image */
+
+    int32_t page = id / 8 / CLUSTER_SIZE;
+    if (!(*vfs)->dirty_inode_bitmap_pages[page]) {
+        (*vfs)->dirty_inode_bitmap_pages[page] = true;
+        (*vfs)->dirty_page_count++;
+    }
+}
+
+void vfs_mark_refcount_dirty(VFS **vfs, int32_t block) {
+    int32_t page = block / (CLUSTER_SIZE / (int)sizeof(uint16_t));
+    if (!(*vfs)->dirty_refcount_pages[page]) {
+        (*vfs)->dirty_refcount_pages[page] = true;
+        (*vfs)->dirty_page_count++;
+    }
+}
+
+void vfs_mark_dedup_dirty(VFS **vfs, int32_t bucket) {
+    int32_t page = bucket / (CLUSTER_SIZE / (int)sizeof(dedup_entry));
+    if (!(*vfs)->dirty_dedup_pages[page]) {
+        (*vfs)->dirty_dedup_pages[page] = true;
+        (*vfs)->dirty_page_count++;
+    }
+}
+
+/*
+ * Writes the dirty pages of a table held in memory, one write per run of neighbouring pages
+ */
+static void commit_dirty_pages(VFS **vfs, const void *table, int32_t bytes,
+                               bool *dirty, int32_t page_count, int32_t start_address) {
+
+    for (int32_t page = 0; page < page_count; ) {
+        if (!dirty[page]) { page++; continue; }
+        int32_t end = page;
+        while (end < page_count && dirty[end]) {
+            dirty[end++] = false;
+        }
+        int32_t first = page * CLUSTER_SIZE;
+        int32_t last = end * CLUSTER_SIZE;
+        if (last > bytes) last = bytes;
+        if (first < last) {
+            vfs_pwrite(vfs, (const uint8_t *)table + first, last - first, start_address + first);
+        }
+        page = end;
+    }
+}
+
+/*
+ * Commit point: writes dirty inode table and bitmap pages, merging neighbouring
+ * pages into one write, then dirty data clusters, and flushes the image.
+ */
+void vfs_commit(VFS **vfs) {
+    if (!vfs || !*vfs || !(*vfs)->vfs_file || !(*vfs)->superblock) return;
+
+    if ((*vfs)->dirty_page_count > 0) {
+        superblock *sb = (*vfs)->superblock;
+
+        int32_t inode_pages = inode_page_count(vfs);
+        for (int32_t page = 0; page < inode_pages; ) {
+            if (!(*vfs)->dirty_inode_pages[page]) { page++; continue; }
+            int32_t end = page;
+            while (end < inode_pages && (*vfs)->dirty_inode_pages[end]) {
+                (*vfs)->dirty_inode_pages[end++] = false;
+            }
+            int32_t first = page * INODES_PER_CLUSTER;
+            int32_t last = end * INODES_PER_CLUSTER;
+            if (last > sb->inode_count) last = sb->inode_count;
+            if (first < last) write_inode_range(vfs, first, last - first);
+            page = end;
+        }
+
+        commit_dirty_pages(vfs, (*vfs)->data_bitmap, bitmap_word_count(vfs) * (int32_t)sizeof(uint64_t),
+                           (*vfs)->dirty_bitmap_pages, sb->bitmap_cluster_count, sb->bitmap_start_address);
+        commit_dirty_pages(vfs, (*vfs)->inode_bitmap, inode_bitmap_word_count(vfs) * (int32_t)sizeof(uint64_t),
+                           (*vfs)->dirty_inode_bitmap_pages, sb->inode_bitmap_cluster_count,
+                           sb->inode_bitmap_start_address);
+        commit_dirty_pages(vfs, (*vfs)->refcounts, sb->refcount_cluster_count * CLUSTER_SIZE,
+                           (*vfs)->dirty_refcount_pages, sb->refcount_cluster_count, sb->refcount_start_address);
+        commit_dirty_pages(vfs, (*vfs)->dedup_index, sb->dedup_cluster_count * CLUSTER_SIZE,
+                           (*vfs)->dirty_dedup_pages, sb->dedup_cluster_count, sb->dedup_start_address);
+
+        (*vfs)->dirty_page_count = 0;
+    }
+
+    if ((*vfs)->superblock_dirty) {
+        vfs_store_superblock(vfs);
     }
 
     flush_vfs(vfs);
-}
\ No newline at end of file
+}
+
+int32_t bitmap_word_count(VFS **vfs) {
+    return ((*vfs)->superblock->cluster_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+bool bitmap_get(VFS **vfs, int32_t block) {
+    return ((*vfs)->data_bitmap[block / BITMAP_WORD_BITS] >> (block % BITMAP_WORD_BITS)) & 1;
+}
+
+/*
+ * Marks a block used or free; the change is written out on the next commit
+ */
+void bitmap_set(VFS **vfs, int32_t block, bool used) {
+    uint64_t mask = 1ULL << (block % BITMAP_WORD_BITS);
+    if (used) {
+        (*vfs)->data_bitmap[block / BITMAP_WORD_BITS] |= mask;
+    } else {
+        (*vfs)->data_bitmap[block / BITMAP_WORD_BITS] &= ~mask;
+        if (block > 0 && block < (*vfs)->superblock->free_hint) {
+            (*vfs)->superblock->free_hint = block;
+            (*vfs)->superblock_dirty = true;
+        }
+    }
+    vfs_mark_bitmap_dirty(vfs, block);
+}
+
+/*
+ * Owners of a used data block; blocks of images without reference counts have one
+ */
+int32_t refcount_get(VFS **vfs, int32_t block) {
+    return (*vfs)->refcounts ? (*vfs)->refcounts[block] + 1 : 1;
+}
+
+/*
+ * Adds an owner to a used data block. Fails when the volume has no reference counts
+ * or the block already has the most owners a count can hold.
+ */
+bool refcount_share(VFS **vfs, int32_t block) {
+    if (!(*vfs)->refcounts || (*vfs)->refcounts[block] == MAX_CLUSTER_SHARES) return false;
+    (*vfs)->refcounts[block]++;
+    vfs_mark_refcount_dirty(vfs, block);
+    return true;
+}
+
+/*
+ * Drops an owner of a data block and frees the block when it was the last one,
+ * together with its deduplication index entry. Returns true when the block was freed.
+ */
+bool refcount_release(VFS **vfs, int32_t block) {
+    if ((*vfs)->refcounts && (*vfs)->refcounts[block] > 0) {
+        (*vfs)->refcounts[block]--;
+        vfs_mark_refcount_dirty(vfs, block);
+        return false;
+    }
+    dedup_forget(vfs, block);
+    bitmap_set(vfs, block, false);
+    return true;
+}
+
+/*
+ * Removes the index entry of block, if it has one; its contents may change from now on
+ */
+void dedup_forget(VFS **vfs, int32_t block) {
+    if (!(*vfs)->dedup_slots || (*vfs)->dedup_slots[block] == 0) return;
+
+    int32_t bucket = (*vfs)->dedup_slots[block] - 1;
+    memset(&(*vfs)->dedup_index[bucket], 0, sizeof(dedup_entry));
+    (*vfs)->dedup_slots[block] = 0;
+    vfs_mark_dedup_dirty(vfs, bucket);
+}
+
+/*
+ * Indexes block under hash in a free entry of its set, or in place of an entry
+ * with the same hash, or of one chosen by the hash
+ */
+void dedup_insert(VFS **vfs, uint64_t hash, int32_t block) {
+    if (!(*vfs)->dedup_index) return;
+    dedup_forget(vfs, block);
+
+    int32_t set = (int32_t)(hash & (uint64_t)(dedup_bucket_count(vfs) - 1)) & ~(DEDUP_WAYS - 1);
+    int32_t bucket = set + (int32_t)((hash >> 32) % DEDUP_WAYS);
+    for (int32_t i = set; i < set + DEDUP_WAYS; i++) {
+        if ((*vfs)->dedup_index[i].cluster <= 0 || (*vfs)->dedup_index[i].hash == hash) {
+            bucket = i;
+            break;
+        }
+    }
+
+    dedup_entry *entry = &(*vfs)->dedup_index[bucket];
+    if (entry->cluster > 0) (*vfs)->dedup_slots[entry->cluster] = 0;
+
+    entry->hash = hash;
+    entry->cluster = block;
+    (*vfs)->dedup_slots[block] = bucket + 1;
+    vfs_mark_dedup_dirty(vfs, bucket);
+}
+
+int32_t inode_bitmap_word_count(VFS **vfs) {
+    return ((*vfs)->superblock->inode_count + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/*
+ * Marks an inode used or free and keeps the free inode count in the superblock
+ */
+void inode_bitmap_set(VFS **vfs, int32_t id, bool used) {
+    uint64_t mask = 1ULL << (id % BITMAP_WORD_BITS);
+    uint64_t *word = &(*vfs)->inode_bitmap[id / BITMAP_WORD_BITS];
+    if (((*word & mask) != 0) == used) return;
+
+    if (used) {
+        *word |= mask;
+        (*vfs)->superblock->free_inode_count--;
+    } else {
+        *word &= ~mask;
+        (*vfs)->superblock->free_inode_count++;
+    }
+    (*vfs)->superblock_dirty = true;
+    vfs_mark_inode_bitmap_dirty(vfs, id);
+}
@@ -7,13 +7,18 @@
 
 #include "structures.h"
 #include "constants.h"
+#include <sys/uio.h>
 
-void initialize_vfs(VFS **vfs, char *vfs_name);
+void initialize_vfs(VFS **vfs, char *vfs_name, vfs_options *options);
 bool load_vfs(VFS **vfs);
 void needs_format(VFS **vfs);
 
 
 size_t write_vfs(VFS **vfs, const void * ptr, size_t size, size_t count);
+size_t vfs_pwrite(VFS **vfs, const void *ptr, size_t size, long offset);
+size_t vfs_pwrite_direct(VFS **vfs, const void *ptr, size_t size, long offset);
+void vfs_sync_stream(VFS **vfs);
+size_t vfs_pwritev(VFS **vfs, const struct iovec *iov, int count, long offset);
 void write_inode_to_vfs(VFS **vfs, int id);
 size_t vfs_write_int32(VFS **vfs, const void *ptr);
 size_t vfs_write_int8(VFS **vfs, const void *ptr);
@@ -21,15 +26,38 @@ size_t vfs_read(VFS **vfs, void *ptr, size_t size, size_t count);
 size_t vfs_read_int8(VFS **vfs, void *ptr);
 size_t vfs_read_int32(VFS **vfs, void *ptr);
 bool vfs_read_sb(VFS **vfs);
-void vfs_read_inodes(VFS **vfs, int index);
+bool vfs_upgrade_bitmap(VFS **vfs);
+void vfs_store_superblock(VFS **vfs);
+bool vfs_read_inodes(VFS **vfs);
+void inode_decode(const inode_disk *record, inode *node);
+void inode_encode(const inode *node, inode_disk *record);
+uint8_t *inode_inline_data(inode *node);
+bool vfs_inline_enabled(VFS **vfs);
+bool vfs_compress_enabled(VFS **vfs);
 bool vfs_load_directories(VFS **vfs, directory *dir);
-int32_t *get_data_blocks(VFS** vfs, int32_t nodeid, int *block_count, int *rest);
+long vfs_cluster_offset(VFS **vfs, int32_t cluster);
 int seek_data_cluster(VFS **vfs, int block_number);
 int seek_set(VFS **vfs, long int offset);
 int seek_cur(VFS **vfs, long int offset);
 bool load_directory_from_vfs(VFS** vfs, directory *dir, int id);
+int32_t vfs_find_entry(VFS **vfs, int32_t dir_inode, const char *name, int32_t *cluster, int32_t *slot);
+bool vfs_directory_empty(VFS **vfs, int32_t dir_inode);
+void vfs_register_directory(VFS **vfs, directory *dir);
+directory *vfs_open_directory(VFS **vfs, directory *parent, dir_item *item);
+directory *vfs_make_directory(VFS **vfs, directory *dir, char *name);
+directory *vfs_alloc_directory(VFS **vfs);
+void vfs_free_directory(VFS **vfs, directory *dir);
+void free_directory_items(VFS **vfs, directory *dir);
+void vfs_release_directories(VFS **vfs);
+void vfs_close_directory(VFS **vfs, directory *dir);
+void vfs_trim_directories(VFS **vfs);
 void rewind_vfs(VFS **vfs);
 void flush_vfs(VFS **vfs);
+size_t vfs_image_size(VFS **vfs);
+bool vfs_reserve_image(VFS **vfs);
+bool vfs_map_image(VFS **vfs);
+void vfs_unmap_image(VFS **vfs);
+uint8_t *vfs_cluster_ptr(VFS **vfs, int32_t cluster);
 int vfs_seek_from_start(VFS **vfs, long offset);
 void vfs_init_inodes(VFS **vfs);
 void vfs_init_root_directory(VFS **vfs);
@@ -37,9 +65,31 @@ bool vfs_init_memory_structures(VFS **vfs, int32_t vfs_size);
 void vfs_write_superblock_to_file(VFS **vfs);
 void vfs_write_bitmaps_to_file(VFS **vfs);
 void vfs_write_inodes_to_file(VFS **vfs);
-int32_t vfs_find_free_inode(VFS **vfs);
+bool vfs_load_inode_bitmap(VFS **vfs);
+bool vfs_load_refcounts(VFS **vfs);
+bool vfs_load_dedup_index(VFS **vfs);
+int32_t dedup_bucket_count(VFS **vfs);
+int32_t vfs_alloc_inode(VFS **vfs);
+void vfs_free_inode(VFS **vfs, int32_t id);
 int update_directory_in_file(VFS** vfs, directory *dir, dir_item *item, bool create);
 int create_directory_in_file(VFS** vfs, directory *dir, dir_item *item);
 int remove_directory_from_file(VFS** vfs, directory *dir, dir_item *item);
 void update_bitmap_in_file(VFS** vfs, dir_item *item, int8_t value, int32_t *data_blocks, int b_count);
+bool vfs_init_dirty_sets(VFS **vfs);
+void vfs_mark_inode_dirty(VFS **vfs, int32_t id);
+void vfs_mark_bitmap_dirty(VFS **vfs, int32_t block);
+void vfs_mark_inode_bitmap_dirty(VFS **vfs, int32_t id);
+void vfs_mark_refcount_dirty(VFS **vfs, int32_t block);
+void vfs_mark_dedup_dirty(VFS **vfs, int32_t bucket);
+void vfs_commit(VFS **vfs);
+int32_t bitmap_word_count(VFS **vfs);
+bool bitmap_get(VFS **vfs, int32_t block);
+void bitmap_set(VFS **vfs, int32_t block, bool used);
+int32_t inode_bitmap_word_count(VFS **vfs);
+void inode_bitmap_set(VFS **vfs, int32_t id, bool used);
+int32_t refcount_get(VFS **vfs, int32_t block);
+bool refcount_share(VFS **vfs, int32_t block);
+bool refcount_release(VFS **vfs, int32_t block);
+void dedup_forget(VFS **vfs, int32_t block);
+void dedup_insert(VFS **vfs, uint64_t hash, int32_t block);
 #endif //FS_ON_INODE_VFS_H
\ No newline at end of file